@@ -0,0 +1,228 @@
+// Parser benchmark: the single-pass lexer against the previous strtok() parser.
+// Prints one JSON object per result line so runs can be compared by scripts.
+#define SHELLGIBI_NO_MAIN
+#include "../main.c"
+#include <time.h>
+
+// the old parser's redirects[] slots: <, >, >> and the file of >|tee
+static const enum redirect_type legacy_redirect_types[] = {REDIRECT_IN, REDIRECT_OUT, REDIRECT_APPEND, REDIRECT_TEE};
+
+// the strtok() based parser that parse_command() replaced, kept for comparison.
+// It copies every token through a 1024 byte buffer, so lines stay short here.
+int legacy_parse_command(char *buf, struct command_t *command) {
+    const char *splitters = " \t"; // split at whitespace
+    int index, len;
+    len = strlen(buf);
+    while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
+    {
+        buf++;
+        len--;
+    }
+    while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
+        buf[--len] = 0; // trim right whitespace
+
+    if (len > 0 && buf[len - 1] == '?') // auto-complete
+        command->auto_complete = true;
+    if (len > 0 && buf[len - 1] == '&') // background
+        command->background = true;
+
+    // every token could be an argument, reserve room for all of them plus name and NULL
+    int max_args = 0;
+    for (int i = 0; i < len; ++i)
+        if (strchr(splitters, buf[i]) == NULL && (i == 0 || strchr(splitters, buf[i - 1]) != NULL))
+            max_args++;
+    command->argv = arena_alloc(&parse_arena, sizeof(char *) * (max_args + 2));
+    command->args = command->argv + 1;
+
+    char *pch = strtok(buf, splitters);
+    if (pch == NULL)
+        command->name = arena_strndup(&parse_arena, "", 0);
+    else
+        command->name = arena_strndup(&parse_arena, pch, strlen(pch));
+    command->argv[0] = command->name;
+
+    int redirect_index;
+    int pending_redirect = -1; // redirect whose file name is the next token
+    int arg_index = 0;
+    char temp_buf[1024], *arg;
+    while (1) {
+        // tokenize input on splitters
+        pch = strtok(NULL, splitters);
+        if (!pch) break;
+        arg = temp_buf;
+        strcpy(arg, pch);
+        len = strlen(arg);
+
+        if (len == 0) continue; // empty arg, go for next
+        while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
+        {
+            arg++;
+            len--;
+        }
+        while (len > 0 && strchr(splitters, arg[len - 1]) != NULL) arg[--len] = 0; // trim right whitespace
+        if (len == 0) continue; // empty arg, go for next
+
+        // piping to another command
+        if (strcmp(arg, "|") == 0) {
+            struct command_t *c = new_command();
+            int l = strlen(pch);
+            pch[l] = splitters[0]; // restore strtok termination
+            index = 1;
+            while (pch[index] == ' ' || pch[index] == '\t') index++; // skip whitespaces
+
+            legacy_parse_command(pch + index, c);
+            pch[l] = 0; // put back strtok termination
+            command->next = c;
+            continue;
+        }
+
+        // background process
+        if (strcmp(arg, "&") == 0)
+            continue; // handled before
+
+        // file name of a redirection written as "> file"
+        if (pending_redirect != -1) {
+            add_redirect(command, legacy_redirect_types[pending_redirect], pending_redirect == 0 ? 0 : 1,
+                         arena_strndup(&parse_arena, arg, len));
+            pending_redirect = -1;
+            continue;
+        }
+
+        // tee mode, the file name follows as the next token
+        if (strcmp(arg, ">|tee") == 0) {
+            command->tee_output = true;
+            pending_redirect = 3;
+            continue;
+        }
+
+        // handle input redirection
+        redirect_index = -1;
+        if (arg[0] == '<')
+            redirect_index = 0;
+        if (arg[0] == '>') {
+            if (len > 1 && arg[1] == '>') {
+                redirect_index = 2;
+                arg++;
+                len--;
+            } else redirect_index = 1;
+        }
+        if (redirect_index != -1 && len == 1) { // bare "<", ">" or ">>"
+            pending_redirect = redirect_index;
+            continue;
+        }
+        if (redirect_index != -1) {
+            add_redirect(command, legacy_redirect_types[redirect_index], redirect_index == 0 ? 0 : 1,
+                         arena_strndup(&parse_arena, arg + 1, len - 1));
+            continue;
+        }
+
+        // normal arguments
+        if (len > 2 && ((arg[0] == '"' && arg[len - 1] == '"')
+                        || (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
+        {
+            arg[--len] = 0;
+            arg++;
+        }
+        command->args[arg_index++] = arena_strndup(&parse_arena, arg, len);
+    }
+    command->arg_count = arg_index;
+    command->args[arg_index] = NULL;
+    return 0;
+}
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// a mix of what an interactive session looks like: options, paths, quotes, pipes, redirects
+char *synthetic_line(int i) {
+    char *line = malloc(512);
+    switch (i % 4) {
+        case 0:
+            snprintf(line, 512, "ls -la /usr/share/doc/package-%d /var/log/syslog.%d", i, i % 7);
+            break;
+        case 1:
+            snprintf(line, 512, "grep -n \"pattern %d\" src/file_%d.c | sort | uniq -c | sort -rn | head -20", i, i);
+            break;
+        case 2:
+            snprintf(line, 512, "gcc -O2 -Wall -Wextra -Iinclude -DVERSION=%d -c src/module_%d.c -o build/module_%d.o >build/log_%d.txt",
+                     i, i, i, i);
+            break;
+        default:
+            snprintf(line, 512, "echo 'literal %d' \"quoted %d\" plain_%d >> out.log &", i, i, i);
+            break;
+    }
+    return line;
+}
+
+typedef int (*parser_fn)(char *, struct command_t *);
+
+void run(const char *name, parser_fn parse, char **lines, int count, size_t bytes, int rounds) {
+    char *copy = malloc(4096);
+    double start = now_seconds();
+    for (int r = 0; r < rounds; ++r) {
+        for (int i = 0; i < count; ++i) {
+            strcpy(copy, lines[i]); // both parsers write into the line
+            struct command_t *command = new_command();
+            parse(copy, command);
+            arena_reset(&parse_arena);
+        }
+    }
+    double elapsed = now_seconds() - start;
+    double total = (double) count * rounds;
+    printf("{\"bench\":\"parse\",\"impl\":\"%s\",\"lines\":%.0f,\"seconds\":%.4f,"
+           "\"ns_per_line\":%.1f,\"mb_per_s\":%.1f}\n",
+           name, total, elapsed, elapsed * 1e9 / total, bytes * rounds / elapsed / 1e6);
+    free(copy);
+}
+
+// one line with arguments worth `size` bytes, which the old parser cannot take at all
+void run_long_line(size_t size, int rounds) {
+    char *line = malloc(size + 16);
+    strcpy(line, "echo");
+    size_t len = 4;
+    while (len + 12 < size) {
+        memcpy(line + len, " argument_x", 11);
+        len += 11;
+    }
+    line[len] = 0;
+    char *copy = malloc(len + 1);
+
+    double start = now_seconds();
+    int args = 0;
+    for (int r = 0; r < rounds; ++r) {
+        memcpy(copy, line, len + 1);
+        struct command_t *command = new_command();
+        parse_command(copy, command);
+        args = command->arg_count;
+        arena_reset(&parse_arena);
+    }
+    double elapsed = now_seconds() - start;
+    printf("{\"bench\":\"parse_long_line\",\"impl\":\"lexer\",\"bytes\":%zu,\"args\":%d,"
+           "\"us_per_line\":%.1f,\"mb_per_s\":%.1f}\n",
+           len, args, elapsed * 1e6 / rounds, (double) len * rounds / elapsed / 1e6);
+    free(copy);
+    free(line);
+}
+
+int main(int argc, char *argv[]) {
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    char **lines = malloc(sizeof(char *) * count);
+    size_t bytes = 0;
+    for (int i = 0; i < count; ++i) {
+        lines[i] = synthetic_line(i);
+        bytes += strlen(lines[i]);
+    }
+
+    run("strtok", legacy_parse_command, lines, count, bytes, rounds);
+    run("lexer", parse_command, lines, count, bytes, rounds);
+    run_long_line(256 * 1024, 200);
+
+    for (int i = 0; i < count; ++i)
+        free(lines[i]);
+    free(lines);
+    return 0;
+}
@@ -0,0 +1,279 @@
+// Benchmarks for the shell's hot paths outside the parser: starting commands,
+// moving data through pipelines and redirections, command completion and
+// glob expansion.
+// Prints one JSON object per result line, like parse_bench, so runs can be
+// compared by scripts.
+#define SHELLGIBI_NO_MAIN
+#include "../main.c"
+
+char bench_dir[] = "/tmp/shellgibi-bench-XXXXXX";
+
+// parses and runs one line the way run_line() does, returns its exit status
+int bench_line(const char *line) {
+    char *copy = arena_strndup(&parse_arena, line, strlen(line));
+    struct command_t *command = new_command();
+    parse_command(copy, command);
+    process_command(command);
+    arena_reset(&parse_arena);
+    return last_status;
+}
+
+double seconds_since(uint64_t start) {
+    return (now_ns() - start) / 1e9;
+}
+
+// time to start and reap a command that does nothing, with every launch backend
+void bench_launch(int rounds) {
+    for (int backend = 0; launch_backend_names[backend]; ++backend) {
+        launch_backend = backend;
+        bench_line("true"); // hashes the path
+        uint64_t start = now_ns();
+        for (int i = 0; i < rounds; ++i)
+            bench_line("true");
+        double elapsed = seconds_since(start);
+        printf("{\"bench\":\"launch\",\"backend\":\"%s\",\"runs\":%d,\"seconds\":%.4f,\"us_per_launch\":%.1f}\n",
+               launch_backend_names[backend], rounds, elapsed, elapsed * 1e6 / rounds);
+    }
+    launch_backend = LAUNCH_SPAWN;
+}
+
+// bytes from head through `stages` cats into /dev/null
+void bench_pipeline(size_t bytes, int stages) {
+    char line[1024];
+    int used = snprintf(line, sizeof(line), "head -c %zu /dev/zero", bytes);
+    for (int i = 0; i < stages; ++i)
+        used += snprintf(line + used, sizeof(line) - used, " | cat");
+    snprintf(line + used, sizeof(line) - used, " > /dev/null");
+
+    uint64_t start = now_ns();
+    int status = bench_line(line);
+    double elapsed = seconds_since(start);
+    printf("{\"bench\":\"pipeline\",\"stages\":%d,\"bytes\":%zu,\"status\":%d,\"seconds\":%.4f,\"mb_per_s\":%.1f}\n",
+           stages + 1, bytes, status, elapsed, bytes / elapsed / 1e6);
+}
+
+// a large output into a file through ">", ">>" and ">|tee"
+void bench_redirection(size_t bytes) {
+    static const char *modes[] = {">", ">>", ">|tee"};
+    char line[PATH_MAX + 128], file[PATH_MAX];
+    snprintf(file, sizeof(file), "%s/redirect.out", bench_dir);
+    for (int backend = 0; launch_backend_names[backend]; ++backend) {
+        launch_backend = backend;
+        for (int m = 0; m < 3; ++m) {
+            unlink(file);
+            // tee also writes everything to stdout, which must not end up in the results
+            snprintf(line, sizeof(line), "head -c %zu /dev/zero %s %s%s", bytes, modes[m], file,
+                     m == 2 ? " | cat > /dev/null" : "");
+            uint64_t start = now_ns();
+            int status = bench_line(line);
+            double elapsed = seconds_since(start);
+            struct stat st;
+            printf("{\"bench\":\"redirection\",\"mode\":\"%s\",\"backend\":\"%s\",\"bytes\":%lld,\"status\":%d,"
+                   "\"seconds\":%.4f,\"mb_per_s\":%.1f}\n", modes[m], launch_backend_names[backend],
+                   stat(file, &st) == 0 ? (long long) st.st_size : -1LL, status, elapsed, bytes / elapsed / 1e6);
+        }
+    }
+    unlink(file);
+    launch_backend = LAUNCH_SPAWN;
+}
+
+// a text file of about `bytes` bytes of log lines, one in 64 has "needle" in it
+void make_filter_input(const char *file, size_t bytes) {
+    static const char *levels[] = {"INFO", "DEBUG", "WARN", "ERROR"};
+    size_t block_size = 1 << 20, used = 0;
+    char *block = malloc(block_size + 256);
+    for (int i = 0; used < block_size; ++i)
+        used += sprintf(block + used, "2024-01-%02d %s worker %d: request %d took %d ms%s\n", i % 28 + 1,
+                        levels[i % 4], i % 17, i, i % 997, i % 64 == 0 ? " needle" : "");
+    int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    for (size_t written = 0; written < bytes; written += used)
+        write_all(fd, block, used);
+    close(fd);
+    free(block);
+}
+
+// the filter builtins against the coreutils they stand in for, on the same file
+void bench_filters(size_t bytes) {
+    static const char *cases[][3] = {
+            {"count_lines", "count -l %s", "wc -l %s"},
+            {"count_words", "count -w %s", "wc -w %s"},
+            {"count_all", "count %s", "wc %s"},
+            {"match_fixed", "match -c needle %s", "grep -c needle %s"},
+            {"match_regex", "match -c 'took 9[0-9]+ ms' %s", "grep -Ec 'took 9[0-9]+ ms' %s"},
+            {"match_count_pipeline", "match needle %s | count -l", "grep needle %s | wc -l"},
+            {"head_lines", "head -n 1000000 %s", "/usr/bin/head -n 1000000 %s"},
+    };
+    char file[PATH_MAX], out[PATH_MAX], command[2 * PATH_MAX], line[3 * PATH_MAX + 8];
+    snprintf(file, sizeof(file), "%s/filter.txt", bench_dir);
+    snprintf(out, sizeof(out), "%s/filter.out", bench_dir);
+    make_filter_input(file, bytes);
+    struct stat st;
+    stat(file, &st);
+    snprintf(line, sizeof(line), "cat %s > /dev/null", file); // into the page cache
+    bench_line(line);
+
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); ++c) {
+        for (int impl = 1; impl <= 2; ++impl) {
+            snprintf(command, sizeof(command), cases[c][impl], file);
+            snprintf(line, sizeof(line), "%s > %s", command, out);
+            uint64_t start = now_ns();
+            int status = bench_line(line);
+            double elapsed = seconds_since(start);
+            printf("{\"bench\":\"filter\",\"case\":\"%s\",\"impl\":\"%s\",\"bytes\":%lld,\"status\":%d,"
+                   "\"seconds\":%.4f,\"mb_per_s\":%.1f}\n", cases[c][0], impl == 1 ? "builtin" : "coreutils",
+                   (long long) st.st_size, status, elapsed, st.st_size / elapsed / 1e6);
+            fflush(stdout);
+        }
+    }
+    unlink(out);
+    unlink(file);
+}
+
+// a PATH of `dirs` directories with `per_dir` empty executables each
+void make_synthetic_path(int dirs, int per_dir) {
+    size_t capacity = dirs * (strlen(bench_dir) + 16), used = 0;
+    char *path = malloc(capacity);
+    for (int d = 0; d < dirs; ++d) {
+        char dir[PATH_MAX], file[PATH_MAX + 64];
+        snprintf(dir, sizeof(dir), "%s/bin%d", bench_dir, d);
+        mkdir(dir, 0755);
+        for (int i = 0; i < per_dir; ++i) {
+            // shared prefixes so completions return more than one name
+            snprintf(file, sizeof(file), "%s/cmd%c%c_%d_%d", dir, 'a' + i % 26, 'a' + (i / 26) % 26, d, i);
+            close(open(file, O_WRONLY | O_CREAT, 0755));
+        }
+        used += snprintf(path + used, capacity - used, "%s%s", d ? ":" : "", dir);
+    }
+    setenv("PATH", path, 1);
+    free(path);
+}
+
+// TAB on a command name: the first one builds the index, the rest only look up
+void bench_completion(int dirs, int per_dir, int rounds) {
+    static const char *heads[] = {"cmd", "cmda", "cmdqb", "x"};
+    make_synthetic_path(dirs, per_dir);
+
+    char head[64];
+    uint64_t start = now_ns();
+    strcpy(head, "cmd?");
+    populate_suggestion_list(head);
+    double elapsed = seconds_since(start);
+    printf("{\"bench\":\"completion_build\",\"path_dirs\":%d,\"commands\":%d,\"indexed\":%d,\"ms\":%.2f}\n",
+           dirs, dirs * per_dir, command_index.count, elapsed * 1e3);
+    clear_suggestions();
+
+    for (int h = 0; h < 4; ++h) {
+        int matches = 0;
+        start = now_ns();
+        for (int i = 0; i < rounds; ++i) {
+            snprintf(head, sizeof(head), "%s?", heads[h]);
+            populate_suggestion_list(head);
+            matches = possible_commands_count;
+            clear_suggestions();
+        }
+        elapsed = seconds_since(start);
+        printf("{\"bench\":\"completion\",\"head\":\"%s\",\"path_dirs\":%d,\"commands\":%d,\"matches\":%d,"
+               "\"us_per_query\":%.2f}\n", heads[h], dirs, dirs * per_dir, matches, elapsed * 1e6 / rounds);
+    }
+}
+
+// TAB on a file name in a directory of `files` entries: the first one reads the
+// listing, the rest are answered from the directory cache
+void bench_file_completion(int files, int rounds) {
+    static const char *heads[] = {"data/f", "data/f1", "data/f12345", "data/x"};
+    char dir[PATH_MAX], file[PATH_MAX + 32], head[64];
+    snprintf(dir, sizeof(dir), "%s/data", bench_dir);
+    mkdir(dir, 0755);
+    for (int i = 0; i < files; ++i) {
+        snprintf(file, sizeof(file), "%s/f%d", dir, i);
+        close(open(file, O_WRONLY | O_CREAT, 0644));
+    }
+    char *old_cwd = getcwd(NULL, 0);
+    chdir(bench_dir);
+
+    uint64_t start = now_ns();
+    strcpy(head, "data/f12345?");
+    get_possible_file_list(head);
+    double elapsed = seconds_since(start);
+    printf("{\"bench\":\"file_completion_read\",\"files\":%d,\"ms\":%.2f}\n", files, elapsed * 1e3);
+    clear_suggestions();
+
+    for (int h = 0; h < 4; ++h) {
+        int matches = 0;
+        start = now_ns();
+        for (int i = 0; i < rounds; ++i) {
+            snprintf(head, sizeof(head), "%s?", heads[h]);
+            get_possible_file_list(head);
+            matches = possible_commands_count;
+            clear_suggestions();
+        }
+        elapsed = seconds_since(start);
+        printf("{\"bench\":\"file_completion\",\"head\":\"%s\",\"files\":%d,\"matches\":%d,"
+               "\"us_per_query\":%.2f}\n", heads[h], files, matches, elapsed * 1e6 / rounds);
+    }
+    chdir(old_cwd);
+    free(old_cwd);
+}
+
+// expands "rm logs/*.gz" and friends over `files` names, half of them .gz
+void bench_glob(int files, int rounds) {
+    static const char *lines[] = {"rm logs/*.gz", "rm logs/f1?3*.gz", "rm logs/*[05].log", "rm logs/*a*a*a*a*b"};
+    char dir[PATH_MAX], file[PATH_MAX + 32];
+    snprintf(dir, sizeof(dir), "%s/logs", bench_dir);
+    mkdir(dir, 0755);
+    for (int i = 0; i < files; ++i) {
+        snprintf(file, sizeof(file), "%s/f%d.%s", dir, i, i % 2 ? "gz" : "log");
+        close(open(file, O_WRONLY | O_CREAT, 0644));
+    }
+    char *old_cwd = getcwd(NULL, 0);
+    chdir(bench_dir);
+
+    for (int l = 0; l < 4; ++l) {
+        int words = 0;
+        uint64_t start = now_ns();
+        for (int i = 0; i < rounds; ++i) {
+            struct command_t *command = new_command();
+            parse_command(arena_strndup(&parse_arena, lines[l], strlen(lines[l])), command);
+            expand_command(command);
+            words = command->arg_count;
+            arena_reset(&parse_arena);
+        }
+        double elapsed = seconds_since(start);
+        printf("{\"bench\":\"glob\",\"line\":\"%s\",\"files\":%d,\"words\":%d,\"ms_per_line\":%.3f}\n",
+               lines[l], files, words, elapsed * 1e3 / rounds);
+    }
+    chdir(old_cwd);
+    free(old_cwd);
+}
+
+void remove_bench_dir() {
+    char command[PATH_MAX + 16];
+    snprintf(command, sizeof(command), "rm -rf %s", bench_dir);
+    system(command);
+}
+
+int main(int argc, char *argv[]) {
+    int launches = argc > 1 ? atoi(argv[1]) : 2000;
+    size_t bytes = argc > 2 ? strtoull(argv[2], NULL, 10) : 256 << 20;
+    size_t filter_bytes = argc > 3 ? strtoull(argv[3], NULL, 10) : (size_t) 256 << 20; // pass e.g. 2147483648 for a multi-GB run
+    if (mkdtemp(bench_dir) == NULL) {
+        fprintf(stderr, "shell_bench: %s: %s\n", bench_dir, strerror(errno));
+        return 1;
+    }
+    char *old_path = getenv("PATH") ? strdup(getenv("PATH")) : NULL;
+
+    bench_launch(launches);
+    for (int stages = 0; stages <= 4; stages += 2)
+        bench_pipeline(bytes, stages);
+    bench_redirection(bytes);
+    bench_filters(filter_bytes);
+    bench_completion(100, 100, 10000);
+    bench_file_completion(200000, 100);
+    bench_glob(100000, 20);
+
+    if (old_path)
+        setenv("PATH", old_path, 1);
+    free(old_path);
+    remove_bench_dir();
+    return 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // splice(), tee()
 #include <unistd.h>
 #include <sys/wait.h>
 #include <stdio.h>
@@ -8,24 +9,69 @@
 #include <errno.h>
 #include <signal.h>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pwd.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <sched.h>
 
 const char *sysname = "shellgibi";
-
-// list of commands that we implemented
-char command_names [8][256] = {"wiki", "alarm", "volume", "myjobs", "pause", "mybg", "myfg", "psvis"};
+bool interactive = false; // reading commands from a terminal through prompt()
+int last_status = 0; // exit status of the last foreground pipeline
+bool terminal_is_raw = false; // the line editor owns the terminal
 
 enum return_codes {
     SUCCESS = 0,
     EXIT = 1,
     UNKNOWN = 2,
 };
+enum redirect_type {
+    REDIRECT_IN, // n<file
+    REDIRECT_OUT, // n>file
+    REDIRECT_APPEND, // n>>file
+    REDIRECT_TEE, // ">|tee file": the file and stdout both get the output
+    REDIRECT_DUP, // n>&m and n<&m, n>&- closes n
+    REDIRECT_HERE, // <<WORD here-document and <<<word here-string
+};
+
+struct redirect {
+    enum redirect_type type;
+    int fd; // the descriptor that is redirected
+    int from_fd; // REDIRECT_DUP: the descriptor copied onto fd, -1 to close fd
+    char *target; // file name, or the here data once it has been read
+    size_t len; // length of the here data
+    bool unread; // here-document whose target is still the delimiter
+    bool strip_tabs; // <<- removes leading tabs from the body and the delimiter line
+    bool word; // here-string, expanded like an argument
+    struct redirect *next; // applied in the order written, "> f 2>&1" differs from "2>&1 > f"
+};
+
 struct command_t {
     char *name;
     bool background;
     bool auto_complete;
     int arg_count;
-    char **args;
-    char *redirects[3]; // in/out redirection
+    char **argv; // name, args and a NULL: ready for execv()
+    char **args; // argv + 1
+    struct redirect *redirects; // list in the order written
+    bool tee_output; // ">|tee file": write to the file and to stdout
+    bool expand; // some word still holds markers for expand_command()
+    struct launch_settings *launch; // from the pin, nice, ionice and rlimit prefixes, NULL if none
+    const char *path; // resolved executable, points into the command hash
     struct command_t *next; // for piping
 };
 
@@ -42,746 +88,6456 @@ int open_wikipedia(struct command_t *command);
 int handle_volume(struct command_t *command);
 int myjobs(struct command_t *command);
 int pause_process(struct command_t *command);
+int parallel_command(struct command_t *command);
+int match_command(struct command_t *command);
+int count_command(struct command_t *command);
+int head_command(struct command_t *command);
+int time_command(struct command_t *command);
+int cache_command(struct command_t *command);
+int launch_prefix(struct command_t *command);
+int shellstats(struct command_t *command);
+int psvis(struct command_t *command);
+int run_program(struct command_t *command);
+int hash_command(struct command_t *command);
+int set_command(struct command_t *command);
+int allocstats(struct command_t *command);
+int cd_command(struct command_t *command);
+int exit_command(struct command_t *command);
+void run_stage(struct command_t *command);
+int mybg(struct command_t *command);
+int myfg(struct command_t *command);
+void init_jobs();
+void notify_jobs();
+void reap_jobs();
+bool jobs_need_notice();
+void terminal_raw(bool raw);
 
-char suggestion_list[1024][256];
-int possible_commands_count = 0;
+// directories listed in $PATH, in search order
+struct path_dir {
+    char *path;
+    bool mtime_valid; // mtime is only recorded once something is hashed from here
+    struct timespec mtime;
+};
 
-// gets all the possible commands
-void get_possible_list(char *head, char *path) {
-    DIR *d;
-    struct dirent *dir;
-    d = opendir(path);
-    if (d) {
-        while ((dir = readdir(d)) != NULL) {
-            // gets written characters from command line and compares with the commands in the path
-            if (strncmp(dir->d_name, head, strlen(head)) == 0) {
-                // puts matched commands to the suggestion_list character array
-                strcpy(suggestion_list[possible_commands_count++], dir->d_name);
-            }
-        }
-        closedir(d);
+// maps a command name to the absolute path it was found at
+struct hash_entry {
+    char *name;
+    char *path;
+    int dir; // index into path_dirs
+    unsigned long hits;
+    struct hash_entry *next;
+};
+
+#define HASH_BUCKETS 256
+#define DEFAULT_PATH "/bin:/usr/bin:/usr/local/bin:/sbin"
+
+struct path_dir *path_dirs = NULL;
+int path_dir_count = 0;
+char *path_dirs_source = NULL; // value of $PATH that path_dirs was built from
+struct hash_entry *command_hash[HASH_BUCKETS];
+int command_hash_count = 0;
+unsigned long hash_hits = 0, hash_misses = 0;
+
+unsigned int hash_string(const char *s) {
+    unsigned int h = 2166136261u; // FNV-1a
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619u;
     }
+    return h;
 }
 
-// gets all the possible commands implemented by us
-void get_possible_special_list(char *head) {
-    for (int i = 0; i < 8; ++i) {
-        if (strncmp(command_names[i], head, strlen(head)) == 0) {
-            strcpy(suggestion_list[possible_commands_count++], command_names[i]);
+// drops every hashed command that came from directory `dir` or a later one
+void hash_forget_from(int dir) {
+    for (int i = 0; i < HASH_BUCKETS; ++i) {
+        struct hash_entry **link = &command_hash[i];
+        while (*link) {
+            struct hash_entry *e = *link;
+            if (e->dir >= dir) {
+                *link = e->next;
+                free(e->name);
+                free(e->path);
+                free(e);
+                command_hash_count--;
+            } else {
+                link = &e->next;
+            }
         }
     }
+    for (int i = dir; i < path_dir_count; ++i)
+        path_dirs[i].mtime_valid = false;
 }
 
-// gets all the possible file names within the current directory
-void get_possible_file_list(char *head) {
-    head[strlen(head) - 1] = '\0';
-    DIR *d;
-    struct dirent *dir;
-    char cwd[250];
-    getcwd(cwd, sizeof(cwd)); // gets current directory
-    d = opendir(cwd);
-    if (d) {
-        while ((dir = readdir(d)) != NULL) {
-            if (strncmp(dir->d_name, head, strlen(head)) == 0) {
-                strcpy(suggestion_list[possible_commands_count++], dir->d_name);
-            }
-        }
-        closedir(d);
+// splits $PATH into path_dirs, rebuilding only when $PATH has changed
+void load_path_dirs() {
+    const char *path = getenv("PATH");
+    if (path == NULL)
+        path = DEFAULT_PATH;
+    if (path_dirs_source != NULL && strcmp(path_dirs_source, path) == 0)
+        return;
+
+    hash_forget_from(0);
+    for (int i = 0; i < path_dir_count; ++i)
+        free(path_dirs[i].path);
+    free(path_dirs);
+    free(path_dirs_source);
+    path_dirs_source = strdup(path);
+
+    path_dir_count = 1;
+    for (const char *p = path; *p; ++p)
+        if (*p == ':')
+            path_dir_count++;
+    path_dirs = calloc(path_dir_count, sizeof(struct path_dir));
+
+    const char *start = path;
+    for (int i = 0; i < path_dir_count; ++i) {
+        const char *end = strchr(start, ':');
+        size_t len = end ? (size_t) (end - start) : strlen(start);
+        if (len == 0) // an empty entry means the current directory
+            path_dirs[i].path = strdup(".");
+        else
+            path_dirs[i].path = strndup(start, len);
+        start = end ? end + 1 : start + len;
     }
 }
 
-// creates possible paths
-void populate_suggestion_list(char *head) {
-    head[strlen(head) - 1] = '\0';
-    char path1[100] = "/bin/";
-    char path2[100] = "/usr/bin/";
-    char path3[100] = "/usr/local/bin/";
-    char path4[100] = "/sbin/";
-    get_possible_list(head, path1);
-    get_possible_list(head, path2);
-    get_possible_list(head, path3);
-    get_possible_list(head, path4);
-    get_possible_special_list(head);
+// true if the directory was modified since its commands were hashed
+bool path_dir_changed(int dir) {
+    struct stat st;
+    if (!path_dirs[dir].mtime_valid)
+        return false;
+    if (stat(path_dirs[dir].path, &st) == -1)
+        return true;
+    return st.st_mtim.tv_sec != path_dirs[dir].mtime.tv_sec
+           || st.st_mtim.tv_nsec != path_dirs[dir].mtime.tv_nsec;
 }
 
-void print_command(struct command_t *command) {
-    int i = 0;
-    printf("Command: <%s>\n", command->name);
-    printf("\tIs Background: %s\n", command->background ? "yes" : "no");
-    printf("\tNeeds Auto-complete: %s\n", command->auto_complete ? "yes" : "no");
-    printf("\tRedirects:\n");
-    for (i = 0; i < 3; i++)
-        printf("\t\t%d: %s\n", i, command->redirects[i] ? command->redirects[i] : "N/A");
-    printf("\tArguments (%d):\n", command->arg_count);
-    for (i = 0; i < command->arg_count; ++i)
-        printf("\t\tArg %d: %s\n", i, command->args[i]);
-    if (command->next) {
-        printf("\tPiped to:\n");
-        print_command(command->next);
+// searches $PATH for an executable called name and adds it to the hash
+struct hash_entry *hash_insert(const char *name) {
+    size_t name_len = strlen(name);
+    for (int i = 0; i < path_dir_count; ++i) {
+        size_t dir_len = strlen(path_dirs[i].path);
+        char *candidate = malloc(dir_len + name_len + 2);
+        memcpy(candidate, path_dirs[i].path, dir_len);
+        candidate[dir_len] = '/';
+        memcpy(candidate + dir_len + 1, name, name_len + 1);
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            if (!path_dirs[i].mtime_valid && stat(path_dirs[i].path, &st) == 0) {
+                path_dirs[i].mtime = st.st_mtim;
+                path_dirs[i].mtime_valid = true;
+            }
+            struct hash_entry *e = malloc(sizeof(struct hash_entry));
+            unsigned int bucket = hash_string(name) % HASH_BUCKETS;
+            e->name = strdup(name);
+            e->path = candidate;
+            e->dir = i;
+            e->hits = 0;
+            e->next = command_hash[bucket];
+            command_hash[bucket] = e;
+            command_hash_count++;
+            return e;
+        }
+        free(candidate);
     }
+    return NULL;
 }
 
 /**
- * Release allocated memory of a command
- * @param  command [description]
- * @return         [description]
+ * Resolve a command name to an executable path through the command hash.
+ * A hit costs one stat() of the directory it came from; a miss walks $PATH once.
+ * @param  name command name without any '/'
+ * @return      absolute path or NULL if it is not in $PATH
  */
-int free_command(struct command_t *command) {
-    if (command == 0) {
-        return 0;
-    }
-    if (command->arg_count) {
-        for (int i = 0; i < command->arg_count; ++i)
-            free(command->args[i]);
-        free(command->args);
-    }
-    for (int i = 0; i < 3; ++i)
-        if (command->redirects[i])
-            free(command->redirects[i]);
-    if (command->next) {
-        free_command(command->next);
-        command->next = NULL;
+const char *hash_lookup(const char *name) {
+    load_path_dirs();
+    unsigned int bucket = hash_string(name) % HASH_BUCKETS;
+    for (struct hash_entry *e = command_hash[bucket]; e; e = e->next) {
+        if (strcmp(e->name, name) != 0)
+            continue;
+        if (path_dir_changed(e->dir)) { // directory changed, rehash everything from it onwards
+            hash_forget_from(e->dir);
+            break;
+        }
+        hash_hits++;
+        e->hits++;
+        return e->path;
     }
-    free(command->name);
-    free(command);
-    return 0;
+    hash_misses++;
+    struct hash_entry *e = hash_insert(name);
+    if (e == NULL)
+        return NULL;
+    e->hits++;
+    return e->path;
 }
 
-char auto_complete_command[256];
+// shell settings changed with the "set" builtin
+struct shell_setting {
+    const char *name;
+    int *value;
+    const char *description;
+    const char *const *choices; // names for the values 0, 1, ... or NULL for a plain number
+    char **text; // set instead of value for text settings
+    void (*changed)(); // called after a new value is set
+};
 
-/**
- * Show the command prompt
- * @return [description]
- */
-int show_prompt() {
-    char cwd[1024], hostname[1024];
-    gethostname(hostname, sizeof(hostname));
-    getcwd(cwd, sizeof(cwd));
-    printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
-    return 0;
-}
+int pipe_buffer_size = 0; // F_SETPIPE_SZ for pipeline pipes, 0 keeps the kernel default
 
-/**
- * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
- * @return         0
- */
-int parse_command(char *buf, struct command_t *command) {
-    const char *splitters = " \t"; // split at whitespace
-    int index, len;
-    len = strlen(buf);
-    while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
-    {
-        buf++;
-        len--;
-    }
-    while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-        buf[--len] = 0; // trim right whitespace
-
-    if (len > 0 && buf[len - 1] == '?') // auto-complete
-        command->auto_complete = true;
-    if (len > 0 && buf[len - 1] == '&') // background
-        command->background = true;
+// how external commands are started
+enum launch_backend {
+    LAUNCH_FORK = 0,
+    LAUNCH_VFORK = 1,
+    LAUNCH_SPAWN = 2,
+};
+int launch_backend = LAUNCH_SPAWN;
+const char *const launch_backend_names[] = {"fork", "vfork", "spawn", NULL};
 
-    char *pch = strtok(buf, splitters);
-    command->name = (char *) malloc(strlen(pch) + 1);
-    if (pch == NULL)
-        command->name[0] = 0;
-    else
-        strcpy(command->name, pch);
+// per-command latency histograms, see shellstats
+int stats_enabled = 0;
+const char *const on_off_names[] = {"off", "on", NULL};
 
-    command->args = (char **) malloc(sizeof(char *));
+int save_alarms = 1; // keep pending alarms in ~/.shellgibi_alarms
+int cache_limit = 256; // megabytes kept by the cache builtin before the oldest entries go
 
-    int redirect_index;
-    int arg_index = 0;
-    char temp_buf[1024], *arg;
-    while (1) {
-        // tokenize input on splitters
-        pch = strtok(NULL, splitters);
-        if (!pch) break;
-        arg = temp_buf;
-        strcpy(arg, pch);
-        len = strlen(arg);
-
-        if (len == 0) continue; // empty arg, go for next
-        while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
-        {
-            arg++;
-            len--;
-        }
-        while (len > 0 && strchr(splitters, arg[len - 1]) != NULL) arg[--len] = 0; // trim right whitespace
-        if (len == 0) continue; // empty arg, go for next
+char *prompt_format = NULL; // PS1 style, see compile_prompt()
+void prompt_format_changed();
 
-        // piping to another command
-        if (strcmp(arg, "|") == 0) {
-            struct command_t *c = malloc(sizeof(struct command_t));
-            int l = strlen(pch);
-            pch[l] = splitters[0]; // restore strtok termination
-            index = 1;
-            while (pch[index] == ' ' || pch[index] == '\t') index++; // skip whitespaces
-
-            parse_command(pch + index, c);
-            pch[l] = 0; // put back strtok termination
-            command->next = c;
-            continue;
-        }
+struct shell_setting shell_settings[] = {
+        {"pipesize", &pipe_buffer_size, "pipe buffer size in bytes for pipelines (0 = default)", NULL, NULL, NULL},
+        {"launch", &launch_backend, "how external commands are started: fork, vfork or spawn",
+                launch_backend_names, NULL, NULL},
+        {"alarmsave", &save_alarms, "keep pending alarms in ~/.shellgibi_alarms across sessions", on_off_names,
+                NULL, NULL},
+        {"cachesize", &cache_limit, "size of the cache builtin's store in megabytes", NULL, NULL, NULL},
+        {"stats", &stats_enabled, "record parse, spawn, exec and wait latencies for shellstats", on_off_names,
+                NULL, NULL},
+        {"prompt", NULL, "prompt format: \\u user, \\h host, \\w cwd, \\W its last part, \\s shell, \\$ # for root",
+                NULL, &prompt_format, prompt_format_changed},
+};
+#define SETTING_COUNT (int) (sizeof(shell_settings) / sizeof(shell_settings[0]))
 
-        // background process
-        if (strcmp(arg, "&") == 0)
-            continue; // handled before
-
-        // handle input redirection
-        redirect_index = -1;
-        if (arg[0] == '<')
-            redirect_index = 0;
-        if (arg[0] == '>') {
-            if (len > 1 && arg[1] == '>') {
-                redirect_index = 2;
-                arg++;
-                len--;
-            } else redirect_index = 1;
-        }
-        if (redirect_index != -1) {
-            command->redirects[redirect_index] = malloc(len);
-            strcpy(command->redirects[redirect_index], arg + 1);
+// set: lists settings, "set name value" changes one
+void print_setting(struct shell_setting *setting, bool verbose) {
+    if (setting->text)
+        printf("%s\t%s", setting->name, *setting->text ? *setting->text : "");
+    else if (setting->choices)
+        printf("%s\t%s", setting->name, setting->choices[*setting->value]);
+    else
+        printf("%s\t%d", setting->name, *setting->value);
+    if (verbose)
+        printf("\t%s", setting->description);
+    printf("\n");
+}
+
+int set_command(struct command_t *command) {
+    if (command->arg_count == 0) {
+        for (int i = 0; i < SETTING_COUNT; ++i)
+            print_setting(&shell_settings[i], true);
+        return SUCCESS;
+    }
+    for (int i = 0; i < SETTING_COUNT; ++i) {
+        struct shell_setting *setting = &shell_settings[i];
+        if (strcmp(setting->name, command->args[0]) != 0)
             continue;
+        if (command->arg_count < 2) {
+            print_setting(setting, false);
+            return SUCCESS;
         }
-
-        // normal arguments
-        if (len > 2 && ((arg[0] == '"' && arg[len - 1] == '"')
-                        || (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
-        {
-            arg[--len] = 0;
-            arg++;
+        if (setting->text) {
+            free(*setting->text);
+            *setting->text = strdup(command->args[1]);
+        } else if (setting->choices == NULL) {
+            *setting->value = atoi(command->args[1]);
+        } else {
+            int j = 0;
+            while (setting->choices[j] && strcmp(setting->choices[j], command->args[1]) != 0)
+                j++;
+            if (setting->choices[j] == NULL) {
+                printf("-%s: set: %s: invalid value for %s\n", sysname, command->args[1], setting->name);
+                return UNKNOWN;
+            }
+            *setting->value = j;
         }
-        command->args = (char **) realloc(command->args, sizeof(char *) * (arg_index + 1));
-        command->args[arg_index] = (char *) malloc(len + 1);
-        strcpy(command->args[arg_index++], arg);
+        if (setting->changed)
+            setting->changed();
+        return SUCCESS;
     }
-    command->arg_count = arg_index;
-    return 0;
+    printf("-%s: set: %s: unknown setting\n", sysname, command->args[0]);
+    return UNKNOWN;
 }
 
-void prompt_backspace() {
-    putchar(8); // go back 1
-    putchar(' '); // write empty over
-    putchar(8); // go back 1 again
-}
+// Builtins are found through a perfect hash that is fixed at compile time: the
+// slot of a name is computed from its length, first, third and last characters,
+// and the multipliers were picked so that no two builtins share a slot. Every
+// entry is placed with BUILTIN_SLOT(), so a new builtin that collides shows up as
+// an overridden initializer, which the Makefile makes an error
+// (-Werror=override-init), and needs new multipliers.
 
-/**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
- */
-int prompt(struct command_t *command) {
-    int index = 0;
-    char c;
-    char buf[4096];
-    static char oldbuf[4096];
+#define BUILTIN_SLOTS 64
+#define BUILTIN_SLOT(len, first, third, last) (((first) + (third) * 10 + (last) * 6 + (len)) & (BUILTIN_SLOTS - 1))
 
-    // tcgetattr gets the parameters of the current terminal
-    // STDIN_FILENO will tell tcgetattr that it should write the settings
-    // of stdin to oldt
-    static struct termios backup_termios, new_termios;
-    tcgetattr(STDIN_FILENO, &backup_termios);
-    new_termios = backup_termios;
-    // ICANON normally takes care that one line at a time will be processed
-    // that means it will return if it sees a "\n" or an EOF or an EOL
-    new_termios.c_lflag &= ~(ICANON | ECHO); // Also disable automatic echo. We manually echo each char.
-    // Those new settings will be set to STDIN
-    // TCSANOW tells tcsetattr to change attributes immediately.
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+enum builtin_flags {
+    BUILTIN_EXIT = 1, // leaves the shell when run in the shell process
+    BUILTIN_EXTERNAL = 2, // only rewrites argv into an external command, which is then launched normally
+    BUILTIN_PREFIX = 4, // takes the rest of the line as a command and runs it through process_command()
+    BUILTIN_FILTER = 8, // reads stdin, so it runs in a child of its own even when it stands alone
+};
 
+struct builtin {
+    const char *name;
+    int (*run)(struct command_t *command);
+    int flags;
+};
 
-    //FIXME: backspace is applied before printing chars
-    show_prompt();
-    int multicode_state = 0;
-    buf[0] = 0;
-    while (1) {
-        c = getchar();
-        // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+int open_wikipedia(struct command_t *command);
+int handle_volume(struct command_t *command);
 
-        if (c == 9) // handle tab
-        {
-            buf[index++] = '?'; // autocomplete
-            break;
-        }
+const struct builtin builtin_table[BUILTIN_SLOTS] = {
+        [BUILTIN_SLOT(2, 'c', 0, 'd')] = {"cd", cd_command, 0},
+        [BUILTIN_SLOT(4, 'e', 'i', 't')] = {"exit", exit_command, BUILTIN_EXIT},
+        [BUILTIN_SLOT(4, 'h', 's', 'h')] = {"hash", hash_command, 0},
+        [BUILTIN_SLOT(3, 's', 't', 't')] = {"set", set_command, 0},
+        [BUILTIN_SLOT(10, 'a', 'l', 's')] = {"allocstats", allocstats, 0},
+        [BUILTIN_SLOT(4, 'w', 'k', 'i')] = {"wiki", open_wikipedia, BUILTIN_EXTERNAL},
+        [BUILTIN_SLOT(5, 'a', 'a', 'm')] = {"alarm", alarm_clock, 0},
+        [BUILTIN_SLOT(6, 'v', 'l', 'e')] = {"volume", handle_volume, BUILTIN_EXTERNAL},
+        [BUILTIN_SLOT(6, 'm', 'j', 's')] = {"myjobs", myjobs, 0},
+        [BUILTIN_SLOT(5, 'p', 'u', 'e')] = {"pause", pause_process, 0},
+        [BUILTIN_SLOT(4, 'm', 'b', 'g')] = {"mybg", mybg, 0},
+        [BUILTIN_SLOT(4, 'm', 'f', 'g')] = {"myfg", myfg, 0},
+        [BUILTIN_SLOT(5, 'p', 'v', 's')] = {"psvis", psvis, 0},
+        [BUILTIN_SLOT(8, 'p', 'r', 'l')] = {"parallel", parallel_command, 0},
+        [BUILTIN_SLOT(4, 't', 'm', 'e')] = {"time", time_command, BUILTIN_PREFIX},
+        [BUILTIN_SLOT(10, 's', 'e', 's')] = {"shellstats", shellstats, 0},
+        [BUILTIN_SLOT(5, 'c', 'c', 'e')] = {"cache", cache_command, BUILTIN_PREFIX},
+        [BUILTIN_SLOT(5, 'm', 't', 'h')] = {"match", match_command, BUILTIN_FILTER},
+        [BUILTIN_SLOT(5, 'c', 'u', 't')] = {"count", count_command, BUILTIN_FILTER},
+        [BUILTIN_SLOT(4, 'h', 'a', 'd')] = {"head", head_command, BUILTIN_FILTER},
+        [BUILTIN_SLOT(3, 'p', 'n', 'n')] = {"pin", launch_prefix, BUILTIN_PREFIX},
+        [BUILTIN_SLOT(4, 'n', 'c', 'e')] = {"nice", launch_prefix, BUILTIN_PREFIX},
+        [BUILTIN_SLOT(6, 'i', 'n', 'e')] = {"ionice", launch_prefix, BUILTIN_PREFIX},
+        [BUILTIN_SLOT(6, 'r', 'i', 't')] = {"rlimit", launch_prefix, BUILTIN_PREFIX},
+};
 
-        if (c == 127) // handle backspace
-        {
-            if (index > 0) {
-                prompt_backspace();
-                index--;
-            }
-            continue;
-        }
-        if (c == 27 && multicode_state == 0) // handle multi-code keys
-        {
-            multicode_state = 1;
-            continue;
-        }
-        if (c == 91 && multicode_state == 1) {
-            multicode_state = 2;
-            continue;
-        }
-        if (c == 65 && multicode_state == 2) // up arrow
-        {
-            int i;
-            while (index > 0) {
-                prompt_backspace();
-                index--;
-            }
-            for (i = 0; oldbuf[i]; ++i) {
-                putchar(oldbuf[i]);
-                buf[i] = oldbuf[i];
-            }
-            index = i;
-            continue;
-        } else
-            multicode_state = 0;
+/**
+ * Find a builtin with one hash and one strcmp().
+ * @param  name command name
+ * @return      the builtin or NULL
+ */
+const struct builtin *find_builtin(const char *name) {
+    size_t len = strlen(name);
+    if (len == 0)
+        return NULL;
+    const struct builtin *builtin = &builtin_table[BUILTIN_SLOT(len, (unsigned char) name[0],
+            len > 2 ? (unsigned char) name[2] : 0, (unsigned char) name[len - 1])];
+    if (builtin->name == NULL || strcmp(builtin->name, name) != 0)
+        return NULL;
+    return builtin;
+}
 
-        putchar(c); // echo the character
-        buf[index++] = c;
-        if (index >= sizeof(buf) - 1) break;
-        if (c == '\n') // enter key
-            break;
-        if (c == 4) // Ctrl+D
-            return EXIT;
-    }
-    if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-        index--;
-    buf[index++] = 0; // null terminate string
+int run_builtin(struct command_t *command, const struct builtin *builtin);
 
+// true for the commands that are handled by the shell itself
+bool is_builtin(const char *name) {
+    return find_builtin(name) != NULL;
+}
 
-    strcpy(oldbuf, buf);
+// fills in command->path for every stage of a pipeline
+void resolve_command_paths(struct command_t *command) {
+    for (struct command_t *c = command; c; c = c->next) {
+        if (c->name == NULL || c->name[0] == 0 || strchr(c->name, '/') != NULL || is_builtin(c->name))
+            c->path = NULL;
+        else
+            c->path = hash_lookup(c->name);
+    }
+}
 
-    parse_command(buf, command);
+// completion candidates for the last TAB, grown on demand
+char **suggestion_list = NULL;
+int possible_commands_count = 0;
+int suggestion_capacity = 0;
 
-    // print_command(command); // DEBUG: uncomment for debugging
+void add_suggestion(const char *name) {
+    if (possible_commands_count == suggestion_capacity) {
+        suggestion_capacity = suggestion_capacity ? suggestion_capacity * 2 : 64;
+        suggestion_list = realloc(suggestion_list, sizeof(char *) * suggestion_capacity);
+    }
+    suggestion_list[possible_commands_count++] = strdup(name);
+}
 
-    // restore the old settings
-    tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-    return SUCCESS;
+void clear_suggestions() {
+    for (int i = 0; i < possible_commands_count; ++i)
+        free(suggestion_list[i]);
+    possible_commands_count = 0;
 }
 
-int main() {
-    while (1) {
-        struct command_t *command = malloc(sizeof(struct command_t));
-        memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+// sorted, de-duplicated names of everything in $PATH plus our own commands.
+// Built once and rebuilt only when $PATH or one of its directories changes.
+struct completion_index {
+    char **names;
+    int count;
+    char *pool; // all names, NUL separated
+    size_t pool_size;
+    char *path_source; // $PATH the index was built from
+    struct timespec *mtimes; // one per path_dirs entry
+};
 
-        int code;
-        code = prompt(command);
-        if (code == EXIT) break;
+struct completion_index command_index = {0};
 
-        code = process_command(command);
-        if (code == EXIT) break;
+int compare_names(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
 
-        free_command(command);
+// true if $PATH or any directory in it changed since the index was built
+bool command_index_stale() {
+    load_path_dirs();
+    if (command_index.path_source == NULL || strcmp(command_index.path_source, path_dirs_source) != 0)
+        return true;
+    for (int i = 0; i < path_dir_count; ++i) {
+        struct stat st;
+        struct timespec mtime = {0};
+        if (stat(path_dirs[i].path, &st) == 0)
+            mtime = st.st_mtim;
+        if (mtime.tv_sec != command_index.mtimes[i].tv_sec || mtime.tv_nsec != command_index.mtimes[i].tv_nsec)
+            return true;
     }
+    return false;
+}
 
-    printf("\n");
-    return 0;
+void command_index_add(const char *name, size_t *used) {
+    size_t len = strlen(name) + 1;
+    while (*used + len > command_index.pool_size) {
+        command_index.pool_size = command_index.pool_size ? command_index.pool_size * 2 : 65536;
+        command_index.pool = realloc(command_index.pool, command_index.pool_size);
+    }
+    memcpy(command_index.pool + *used, name, len);
+    *used += len;
+    command_index.count++;
 }
 
-// recursive piping
-int execute_pipeline(struct command_t *command) {
-    int fd[2];
-    pipe(fd);
-    // if fork is not successful, execute command
-    if (!fork()) {
-        close(1); // close normal stdout
-        dup(fd[1]); // make stdout same as fd[1]
-        close(fd[0]);
-        execute(command);
-    } else { //
-        close(0); // close normal stdin
-        dup(fd[0]); // make stdin same as fd[0]
-        close(fd[1]);
-        struct command_t *next = command->next;
-        next->args = (char **) realloc(
-                next->args, sizeof(char *) * (next->arg_count += 2));
-        // shift everything forward by 1
-        for (int i = next->arg_count - 2; i > 0; --i)
-            next->args[i] = next->args[i - 1];
-        // set args[0] as a copy of name
-        next->args[0] = strdup(next->name);
-        // set args[arg_count-1] (last) to NULL
-        next->args[next->arg_count - 1] = NULL;
-        if (next->next) { // if next's next not null, do execute_pipeline
-            execute_pipeline(next);
-        } else { // if next's next is null, execute command
-            execute(next);
+// reads every $PATH directory once and sorts the result
+void command_index_build() {
+    size_t used = 0;
+    command_index.count = 0;
+    free(command_index.path_source);
+    command_index.path_source = strdup(path_dirs_source);
+    command_index.mtimes = realloc(command_index.mtimes, sizeof(struct timespec) * path_dir_count);
+
+    for (int i = 0; i < path_dir_count; ++i) {
+        struct stat st;
+        memset(&command_index.mtimes[i], 0, sizeof(struct timespec));
+        if (stat(path_dirs[i].path, &st) == 0)
+            command_index.mtimes[i] = st.st_mtim;
+        DIR *d = opendir(path_dirs[i].path);
+        if (d == NULL)
+            continue;
+        struct dirent *dir;
+        while ((dir = readdir(d)) != NULL) {
+            if (strcmp(dir->d_name, ".") == 0 || strcmp(dir->d_name, "..") == 0)
+                continue;
+            command_index_add(dir->d_name, &used);
         }
+        closedir(d);
     }
-    return 0;
-}
+    for (int i = 0; i < BUILTIN_SLOTS; ++i)
+        if (builtin_table[i].name != NULL)
+            command_index_add(builtin_table[i].name, &used);
 
-// execute using execv()
-int execute(struct command_t *command) {
+    // the pool may have moved while growing, so pointers are taken afterwards
+    command_index.names = realloc(command_index.names, sizeof(char *) * (command_index.count + 1));
+    char *p = command_index.pool;
+    for (int i = 0; i < command_index.count; ++i) {
+        command_index.names[i] = p;
+        p += strlen(p) + 1;
+    }
+    qsort(command_index.names, command_index.count, sizeof(char *), compare_names);
 
-    // paths where kernel commands are located
-    char path1[100] = "/bin/";
-    char path2[100] = "/usr/bin/";
-    char path3[100] = "/usr/local/bin/";
-    char path4[100] = "/sbin/";
-    int res = 0;
+    int unique = 0;
+    for (int i = 0; i < command_index.count; ++i)
+        if (unique == 0 || strcmp(command_index.names[unique - 1], command_index.names[i]) != 0)
+            command_index.names[unique++] = command_index.names[i];
+    command_index.count = unique;
+}
 
-    // gets current directory as a path
-    if (command->name[0] == '.') {
-        char cwd[250];
-        getcwd(cwd, sizeof(cwd));
-        strcat(cwd, command->name + 1);
-        res = execv(cwd, command->args);
+// first index whose name is not less than head, found by binary search
+int command_index_lower_bound(const char *head) {
+    int lo = 0, hi = command_index.count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(command_index.names[mid], head) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return lo;
+}
 
-    // concatenates command with possible path where it can occur ands executes using execv()
-    strcat(path1, command->name);
-    res = execv(path1, command->args);
+// Directory listings for file name completion, cached by absolute path and
+// checked against the directory's mtime with one stat() per TAB. A listing is
+// read with large getdents64() batches straight into a name pool and kept as a
+// sorted array, so a prefix is found by binary search even in directories with
+// hundreds of thousands of entries.
 
-    strcat(path2, command->name);
-    res = execv(path2, command->args);
+#define DIR_CACHE_SLOTS 8
+#define DIR_READ_BATCH (1 << 20)
+
+// layout of the records returned by getdents64
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
 
-    strcat(path3, command->name);
-    res = execv(path3, command->args);
+struct dir_listing {
+    char *path; // absolute, NULL for an empty slot
+    struct timespec mtime;
+    char *pool; // each entry is its d_type byte followed by the name and a NUL
+    size_t pool_size;
+    uint32_t *entries; // offsets into pool, sorted by name
+    int count;
+    unsigned long last_used;
+};
 
-    strcat(path4, command->name);
-    res = execv(path4, command->args);
+struct dir_listing dir_cache[DIR_CACHE_SLOTS];
+unsigned long dir_cache_clock = 0;
 
-    if (res == -1) {
-        printf("No such command found.\n");
-    }
+const char *dir_entry_name(const struct dir_listing *listing, int i) {
+    return listing->pool + listing->entries[i] + 1;
 }
 
-// redirection command for "<", ">" and ">>"
-int redirection_command(struct command_t *command) {
-    FILE *fp;
-    FILE *com = NULL;
-    char filename[100];
-    char cmd[250] = "";
-    int buffer_size = 128;
-    char output[128];
-
-    // concatenates args one by one to get the typed command till redirection symbol
-    for (int i = 0; i < command->arg_count - 1; i++) {
-        strcat(cmd, command->args[i]);
-        strcat(cmd, " ");
-    }
-    // concatenates "<" to the command
-    if (command->redirects[0] != NULL) {
-        strcat(cmd, "<");
-        strcat(cmd, command->redirects[0]);
-        strcat(cmd, " ");
-    }
-    // concatenates ">" to the command
-    if (command->redirects[1] != NULL) {
-        strcat(cmd, ">");
-        strcat(cmd, command->redirects[1]);
-        strcat(cmd, " ");
-    }
-    // concatenates ">>" to the command
-    if (command->redirects[2] != NULL) {
-        strcat(cmd, ">>");
-        strcat(cmd, command->redirects[2]);
-        strcat(cmd, " ");
-    }
-    // initiate pipe streams and executes command
-    fp = popen(cmd, "r");
-
-    if (command->redirects[0] != NULL) {
-        strcpy(filename, command->redirects[0]);
-        // opens file in read mode
-        com = fopen(filename, "r");
-    }
-    if (command->redirects[1] != NULL) {
-        strcpy(filename, command->redirects[1]);
-        // opens file in write mode
-        com = fopen(filename, "w");
-    }
-    if (command->redirects[2] != NULL) {
-        strcpy(filename, command->redirects[2]);
-        // opens file in append mode
-        com = fopen(filename, "a");
-    }
-    //  reads characters from a given file stream source into an array of characters
-    while (fgets(output, buffer_size, fp) != NULL) {
-        // writes character array to a file
-        fprintf(com, "%s", output);
-        printf("%s", output);
-    }
-    fclose(com);
-    fclose(fp);
-    pclose(fp);
+// qsort() has no context argument, the listing being sorted is passed here
+const char *dir_sort_pool;
 
-    return 0;
+int compare_dir_entries(const void *a, const void *b) {
+    return strcmp(dir_sort_pool + *(const uint32_t *) a + 1, dir_sort_pool + *(const uint32_t *) b + 1);
 }
 
-int process_command(struct command_t *command) {
-    if (command->auto_complete) {
-        possible_commands_count = 0;
-        if(command->next!=NULL) {
-            command = command->next;
-            command->auto_complete=true;
-            process_command(command);
-        } else if (command->arg_count == 0 &&
-            (command->redirects[0] == NULL && command->redirects[1] == NULL && command->redirects[2] == NULL)) {
-            populate_suggestion_list(command->name);
-            printf("\n");
-            if (possible_commands_count==1) {
-                printf("%s\n", suggestion_list[0]);
-            } else {
-                for (int i = 0; i < possible_commands_count; ++i) {
-                    printf("%s\t", suggestion_list[i]);
-                    if (i % 5 == 4) {
-                        printf("\n");
-                    }
-                }
-                printf("\n");
-            }
-            strncpy(auto_complete_command, command->name, strlen(command->name));
-        } else if (!(command->redirects[0] == NULL && command->redirects[1] == NULL && command->redirects[2] == NULL)) {
-            char head[256];
-            if(command->redirects[0] != NULL){
-                strcpy(head,command->redirects[0]);
-            } else if(command->redirects[1] != NULL){
-                strcpy(head,command->redirects[1]);
-            } else if(command->redirects[2] != NULL){
-                strcpy(head,command->redirects[2]);
-            }
-            get_possible_file_list(head);
-            printf("\n");
-            if (possible_commands_count==1) {
-                printf("%s\n", suggestion_list[0]);
-            } else {
-                for (int i = 0; i < possible_commands_count; ++i) {
-                    printf("%s\t", suggestion_list[i]);
-                    if (i % 5 == 4) {
-                        printf("\n");
-                    }
-                }
-                printf("\n");
+// reads the directory into the listing, false if it cannot be opened
+bool dir_listing_read(struct dir_listing *listing, const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    char *batch = malloc(DIR_READ_BATCH);
+    size_t used = 0;
+    int capacity = listing->count = 0;
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, batch, DIR_READ_BATCH)) > 0) {
+        for (long offset = 0; offset < n;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *) (batch + offset);
+            offset += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+                continue;
+            size_t len = strlen(name) + 2;
+            while (used + len > listing->pool_size) {
+                listing->pool_size = listing->pool_size ? listing->pool_size * 2 : 65536;
+                listing->pool = realloc(listing->pool, listing->pool_size);
             }
-            strncpy(auto_complete_command, command->name, strlen(command->name));
-        } else {
-            get_possible_file_list(command->args[command->arg_count - 1]);
-            printf("\n");
-            if (possible_commands_count==1) {
-                printf("%s\n", suggestion_list[0]);
-            } else {
-                for (int i = 0; i < possible_commands_count; ++i) {
-                    printf("%s\t", suggestion_list[i]);
-                    if (i % 5 == 4) {
-                        printf("\n");
-                    }
-                }
-                printf("\n");
+            if (listing->count == capacity) {
+                capacity = capacity ? capacity * 2 : 256;
+                listing->entries = realloc(listing->entries, sizeof(uint32_t) * capacity);
             }
-            strncpy(auto_complete_command, command->name, strlen(command->name));
+            listing->entries[listing->count++] = used;
+            listing->pool[used] = entry->d_type;
+            memcpy(listing->pool + used + 1, name, len - 1);
+            used += len;
         }
-        return 0;
     }
+    free(batch);
+    close(fd);
+    dir_sort_pool = listing->pool;
+    qsort(listing->entries, listing->count, sizeof(uint32_t), compare_dir_entries);
+    return true;
+}
 
-    int r;
-    if (strcmp(command->name, "") == 0) return SUCCESS;
-
-    if (strcmp(command->name, "exit") == 0)
-        return EXIT;
-
-    if (strcmp(command->name, "cd") == 0) {
-        if (command->arg_count > 0) {
-            r = chdir(command->args[0]);
-            if (r == -1)
-                printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-            return SUCCESS;
+/**
+ * The cached listing of a directory, read again when its mtime has changed.
+ * The least recently used slot is given up for a directory not in the cache.
+ * @param  path absolute path
+ * @return      the listing or NULL if the directory cannot be read
+ */
+struct dir_listing *dir_cache_get(const char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1 || !S_ISDIR(st.st_mode))
+        return NULL;
+    struct dir_listing *listing = &dir_cache[0];
+    for (int i = 0; i < DIR_CACHE_SLOTS; ++i) {
+        if (dir_cache[i].path != NULL && strcmp(dir_cache[i].path, path) == 0) {
+            listing = &dir_cache[i];
+            break;
         }
+        if (dir_cache[i].last_used < listing->last_used)
+            listing = &dir_cache[i];
     }
+    listing->last_used = ++dir_cache_clock;
+    if (listing->path != NULL && strcmp(listing->path, path) == 0 && listing->mtime.tv_sec == st.st_mtim.tv_sec
+        && listing->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        return listing;
 
-    pid_t pid = fork();
-    if (pid == 0) // child
-    {
-        /// This shows how to do exec with environ (but is not available on MacOs)
-        // extern char** environ; // environment variables
-        // execvpe(command->name, command->args, environ); // exec+args+path+environ
-
-        /// This shows how to do exec with auto-path resolve
-        // add a NULL argument to the end of args, and the name to the beginning
-        // as required by exec
-
-        // increase args size by 2
-        command->args = (char **) realloc(
-                command->args, sizeof(char *) * (command->arg_count += 2));
+    if (listing->path == NULL || strcmp(listing->path, path) != 0) {
+        free(listing->path);
+        listing->path = strdup(path);
+    }
+    listing->mtime = st.st_mtim;
+    if (!dir_listing_read(listing, path)) {
+        free(listing->path);
+        listing->path = NULL;
+        return NULL;
+    }
+    return listing;
+}
 
-        // shift everything forward by 1
-        for (int i = command->arg_count - 2; i > 0; --i)
-            command->args[i] = command->args[i - 1];
+// first entry whose name is not less than prefix
+int dir_listing_lower_bound(const struct dir_listing *listing, const char *prefix) {
+    int lo = 0, hi = listing->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (strcmp(dir_entry_name(listing, mid), prefix) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
 
-        // set args[0] as a copy of name
-        command->args[0] = strdup(command->name);
-        // set args[arg_count-1] (last) to NULL
-        command->args[command->arg_count - 1] = NULL;
+// DT_UNKNOWN and symlinks are only resolved for the entries that are shown
+bool dir_entry_is_dir(const char *dir, const struct dir_listing *listing, int i) {
+    unsigned char type = listing->pool[listing->entries[i]];
+    if (type != DT_UNKNOWN && type != DT_LNK)
+        return type == DT_DIR;
+    char path[PATH_MAX];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, dir_entry_name(listing, i));
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
 
-        if (command->next != NULL) {
-            execute_pipeline(command);
-        }
+/**
+ * Gets the file names that complete head, which ends in the '?' of the TAB.
+ * Everything up to the last '/' names the directory to look in, relative to
+ * the current one unless it starts with '/'; directories are suggested with a
+ * trailing '/' so completion goes on into them. Dot files only show up when
+ * the prefix starts with a dot.
+ * @param head the word being completed
+ */
+void get_possible_file_list(char *head) {
+    head[strlen(head) - 1] = '\0';
+    char *slash = strrchr(head, '/');
+    const char *prefix = slash ? slash + 1 : head;
+    char *dir;
+    if (slash == head) {
+        dir = strdup("/");
+    } else if (head[0] == '/') {
+        dir = strndup(head, slash - head);
+    } else {
+        char *cwd = getcwd(NULL, 0);
+        if (cwd == NULL)
+            return;
+        if (slash == NULL)
+            dir = cwd;
+        else if (asprintf(&dir, "%s/%.*s", cwd, (int) (slash - head), head) == -1)
+            dir = NULL;
+        if (dir != cwd)
+            free(cwd);
+        if (dir == NULL)
+            return;
+    }
 
-        if (strcmp(command->name, "wiki")==0) // this is our first custom command. For more info
-        {                                     // check the function open_Wikipedia.
-            open_wikipedia(command);
-            return SUCCESS;
-        }
+    struct dir_listing *listing = dir_cache_get(dir);
+    size_t len = strlen(prefix);
+    char name[NAME_MAX + 2];
+    for (int i = listing ? dir_listing_lower_bound(listing, prefix) : 0; listing && i < listing->count; ++i) {
+        const char *entry = dir_entry_name(listing, i);
+        if (strncmp(entry, prefix, len) != 0)
+            break;
+        if (entry[0] == '.' && prefix[0] != '.')
+            continue;
+        snprintf(name, sizeof(name), "%s%s", entry, dir_entry_is_dir(dir, listing, i) ? "/" : "");
+        add_suggestion(name);
+    }
+    free(dir);
+}
 
-        if (strcmp(command->name, "volume")==0) // this is our second custom command. For more info
-        {                                      // check the function handle_volume.
-            handle_volume(command);
-            return SUCCESS;
-        }
+// gets all the possible commands starting with head from the completion index
+void populate_suggestion_list(char *head) {
+    head[strlen(head) - 1] = '\0';
+    if (command_index_stale())
+        command_index_build();
+    size_t len = strlen(head);
+    for (int i = command_index_lower_bound(head); i < command_index.count; ++i) {
+        if (strncmp(command_index.names[i], head, len) != 0)
+            break;
+        add_suggestion(command_index.names[i]);
+    }
+}
 
-        if (strcmp(command->name, "alarm")==0) // this is the alarm clock part. For more info
-                                               // check the function alarm_clock.
-        {
-            alarm_clock(command);
-            return SUCCESS;
-        }
+// bump allocator for everything parse_command() creates. It is reset once per
+// input line, so after the first few lines parsing a command costs no malloc at all.
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
 
-        if (strcmp(command->name, "myjobs")==0) // this is for listing the running jobs. For more info
-                                                // check the function myjobs.
-        {
-            myjobs(command);
-            return SUCCESS;
-        }
+struct arena {
+    struct arena_chunk *head;
+    unsigned long mallocs; // chunks requested from malloc, ever
+    unsigned long resets; // lines parsed
+};
 
-        if (strcmp(command->name, "pause")==0)  // this is for pausing a process givent its pid. For more info
-                                                // check the function pause_process.
-        {
-            pause_process(command);
-            return SUCCESS;
-        }
+#define ARENA_CHUNK (64 * 1024)
 
-        if (!(command->redirects[0] == NULL && command->redirects[1] == NULL && command->redirects[2] == NULL)) {
-            redirection_command(command);
-        } else {
-            execute(command);
-        }
-//        execvp(command->name, command->args); // exec+args+path
+struct arena parse_arena = {0};
 
-        exit(0);
-        // TODO: do your own exec with path resolving using execv()
-    } else {
-        if (!command->background)
-            wait(0); // wait for child process to finish
-        return SUCCESS;
+void *arena_alloc(struct arena *arena, size_t size) {
+    size = (size + 15) & ~(size_t) 15;
+    struct arena_chunk *chunk = arena->head;
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        chunk = malloc(sizeof(struct arena_chunk) + chunk_size);
+        chunk->next = arena->head;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        arena->head = chunk;
+        arena->mallocs++;
     }
-
-    // TODO: your implementation here
-
-    printf("-%s: %s: command not found\n", sysname, command->name);
-    return UNKNOWN;
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
 }
 
+char *arena_strndup(struct arena *arena, const char *s, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, s, len);
+    copy[len] = 0;
+    return copy;
+}
 
-// alarm_clock gives the command to crontab in its appropriate format.
-
-int alarm_clock(struct command_t *command) {
-    char time[6]; // time is in hh.mm
-    strcpy(time, command->args[1]);
-    const char s[2] = ".";  // seperator
-    char* token = strtok(time, s);
-    int minute = -1, hour = -1, count = 0;
+/**
+ * Release everything allocated since the last reset. If the line needed more
+ * than one chunk they are merged into one big enough for it, so the next line
+ * of the same size fits without allocating.
+ */
+void arena_reset(struct arena *arena) {
+    arena->resets++;
+    if (arena->head == NULL)
+        return;
+    if (arena->head->next == NULL) {
+        arena->head->used = 0;
+        return;
+    }
+    size_t total = 0;
+    while (arena->head) {
+        struct arena_chunk *next = arena->head->next;
+        total += arena->head->size;
+        free(arena->head);
+        arena->head = next;
+    }
+    arena->head = malloc(sizeof(struct arena_chunk) + total);
+    arena->head->next = NULL;
+    arena->head->size = total;
+    arena->head->used = 0;
+    arena->mallocs++;
+}
+
+// allocstats: how often the parser had to go to malloc
+int allocstats(struct command_t *command) {
+    (void) command;
+    size_t capacity = 0;
+    for (struct arena_chunk *chunk = parse_arena.head; chunk; chunk = chunk->next)
+        capacity += chunk->size;
+    printf("lines parsed: %lu\n", parse_arena.resets);
+    printf("parser mallocs: %lu\n", parse_arena.mallocs);
+    printf("arena capacity: %zu bytes\n", capacity);
+    return SUCCESS;
+}
+
+// Instrumentation, off unless "set stats on". Every phase of a command goes into
+// a histogram with HDR-style log-linear buckets: values below 16ns get one bucket
+// each, above that every power of two is split into 16 buckets, so any recorded
+// latency is kept to within 1/16 of its value in a fixed 8KB per phase.
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+enum stat_phase {
+    STAT_PARSE, // parse_command()
+    STAT_SPAWN, // starting every stage, until fork/vfork/posix_spawn return
+    STAT_EXEC, // from the last stage being started until the last one exits, or a builtin's run
+    STAT_WAIT, // reaping, exit statuses and the terminal after the job is done
+    STAT_PHASES,
+};
+
+const char *const stat_phase_names[] = {"parse", "spawn", "exec", "wait"};
+
+struct histogram {
+    uint64_t count, sum, min, max; // in nanoseconds
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+struct histogram shell_stats[STAT_PHASES];
+struct rusage child_usage; // summed over children reaped in the foreground, see time_command()
 
-    while(token != NULL) {
-        int time_unit = atoi(token);
-        if (count ==0) {    // time_unit indicates hour
-            hour = time_unit;
+// adds what wait4() reported for one child to a total
+void rusage_add(struct rusage *total, const struct rusage *usage) {
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss)
+        total->ru_maxrss = usage->ru_maxrss;
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int histogram_index(uint64_t value) {
+    if (value < (1 << HISTOGRAM_SUB_BITS))
+        return value;
+    int exponent = 63 - __builtin_clzll(value);
+    return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+           + ((value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1));
+}
+
+// the largest value that falls into a bucket
+uint64_t histogram_value(int index) {
+    if (index < (1 << HISTOGRAM_SUB_BITS))
+        return index;
+    int shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub = index & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return (((1 << HISTOGRAM_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+void stats_record(enum stat_phase phase, uint64_t ns) {
+    struct histogram *h = &shell_stats[phase];
+    if (h->count == 0 || ns < h->min)
+        h->min = ns;
+    if (ns > h->max)
+        h->max = ns;
+    h->count++;
+    h->sum += ns;
+    h->buckets[histogram_index(ns)]++;
+}
+
+uint64_t histogram_percentile(struct histogram *h, double percentile) {
+    uint64_t rank = (uint64_t) (h->count * percentile / 100.0 + 0.5), seen = 0;
+    if (rank == 0)
+        rank = 1;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+        seen += h->buckets[i];
+        if (seen >= rank)
+            return histogram_value(i) < h->max ? histogram_value(i) : h->max;
+    }
+    return h->max;
+}
+
+/**
+ * shellstats [-j|--json] [-r]
+ * Prints the latency histograms as a table in microseconds, or with -j as JSON
+ * in nanoseconds including every non-empty bucket. -r clears them.
+ */
+int shellstats(struct command_t *command) {
+    static const double percentiles[] = {50, 90, 99};
+    bool json = false;
+    for (int i = 0; i < command->arg_count; ++i) {
+        if (strcmp(command->args[i], "-r") == 0) {
+            memset(shell_stats, 0, sizeof(shell_stats));
+            return SUCCESS;
+        } else if (strcmp(command->args[i], "-j") == 0 || strcmp(command->args[i], "--json") == 0) {
+            json = true;
+        } else {
+            printf("-%s: shellstats: usage: shellstats [-j|--json] [-r]\n", sysname);
+            return UNKNOWN;
         }
-        else if(count==1) {  // time_unit indicates hour
-            minute = time_unit;
+    }
+
+    if (json) {
+        printf("{\"enabled\":%s", stats_enabled ? "true" : "false");
+        for (int phase = 0; phase < STAT_PHASES; ++phase) {
+            struct histogram *h = &shell_stats[phase];
+            printf(",\"%s\":{\"count\":%" PRIu64 ",\"min_ns\":%" PRIu64 ",\"mean_ns\":%" PRIu64, stat_phase_names[phase],
+                   h->count, h->min, h->count ? h->sum / h->count : 0);
+            for (int i = 0; i < 3; ++i)
+                printf(",\"p%.0f_ns\":%" PRIu64, percentiles[i], histogram_percentile(h, percentiles[i]));
+            printf(",\"max_ns\":%" PRIu64 ",\"buckets\":[", h->max);
+            bool first = true;
+            for (int i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+                if (h->buckets[i] == 0)
+                    continue;
+                printf("%s[%" PRIu64 ",%" PRIu64 "]", first ? "" : ",", histogram_value(i), h->buckets[i]);
+                first = false;
+            }
+            printf("]}");
         }
-        token = strtok(NULL,s);
-        count++;
+        printf("}\n");
+        return SUCCESS;
+    }
+
+    if (!stats_enabled)
+        printf("instrumentation is off, turn it on with: set stats on\n");
+    printf("%-6s %8s %10s %10s %10s %10s %10s %10s\n", "phase", "count", "min", "mean", "p50", "p90", "p99", "max");
+    for (int phase = 0; phase < STAT_PHASES; ++phase) {
+        struct histogram *h = &shell_stats[phase];
+        printf("%-6s %8" PRIu64 " %10.1f %10.1f", stat_phase_names[phase], h->count, h->min / 1e3,
+               h->count ? h->sum / 1e3 / h->count : 0.0);
+        for (int i = 0; i < 3; ++i)
+            printf(" %10.1f", histogram_percentile(h, percentiles[i]) / 1e3);
+        printf(" %10.1f\n", h->max / 1e3);
+    }
+    printf("(microseconds)\n");
+    return SUCCESS;
+}
+
+// a zeroed command from the parse arena, it lives until the next input line
+struct command_t *new_command() {
+    struct command_t *command = arena_alloc(&parse_arena, sizeof(struct command_t));
+    memset(command, 0, sizeof(struct command_t));
+    return command;
+}
+
+void print_command(struct command_t *command) {
+    int i = 0;
+    printf("Command: <%s>\n", command->name);
+    printf("\tIs Background: %s\n", command->background ? "yes" : "no");
+    printf("\tNeeds Auto-complete: %s\n", command->auto_complete ? "yes" : "no");
+    printf("\tRedirects:\n");
+    for (struct redirect *r = command->redirects; r; r = r->next) {
+        if (r->type == REDIRECT_DUP)
+            printf("\t\t%d: copy of %d\n", r->fd, r->from_fd);
+        else if (r->type == REDIRECT_HERE)
+            printf("\t\t%d: %zu bytes of here data\n", r->fd, r->len);
+        else
+            printf("\t\t%d: %s\n", r->fd, r->target);
+    }
+    printf("\tArguments (%d):\n", command->arg_count);
+    for (i = 0; i < command->arg_count; ++i)
+        printf("\t\tArg %d: %s\n", i, command->args[i]);
+    if (command->next) {
+        printf("\tPiped to:\n");
+        print_command(command->next);
     }
+}
+
+// The prompt format is compiled into segments once. User and host never change,
+// the working directory is cached until cd succeeds, and the rendered prompt is
+// kept until one of them is invalidated, so showing it is a single write().
+
+#define DEFAULT_PROMPT "\\u@\\H:\\w \\s\\$ "
+
+enum prompt_segment_type {
+    PROMPT_TEXT,
+    PROMPT_USER, // \u
+    PROMPT_HOST, // \h, up to the first '.'
+    PROMPT_FULL_HOST, // \H
+    PROMPT_CWD, // \w, with $HOME shown as ~
+    PROMPT_CWD_BASE, // \W
+    PROMPT_SHELL, // \s
+    PROMPT_DOLLAR, // \$, '#' for root
+};
 
-    char input[200];
-    char file[200] = "./";
-    strcat(file, command->args[2]);
+struct prompt_segment {
+    enum prompt_segment_type type;
+    char *text;
+    size_t len;
+};
 
-    char *real_path;
-    real_path = realpath(file, NULL);
+struct prompt_cache {
+    struct prompt_segment *segments;
+    int segment_count;
+    char *user, *host, *full_host, *home;
+    char *cwd; // NULL until needed again after cd
+    char *rendered; // NULL when it has to be rebuilt
+    size_t rendered_len;
+};
 
-    sprintf(input, "%d %d %c %c %c %s %s", minute, hour, '*', '*', '*', "mpg321", real_path);
+struct prompt_cache prompt_cache = {0};
 
-    FILE *file2;
-    DIR *directory;
-    struct dirent *dir;
-    directory = opendir("/var/spool/cron/crontabs");
+void compile_prompt(const char *format) {
+    for (int i = 0; i < prompt_cache.segment_count; ++i)
+        free(prompt_cache.segments[i].text);
+    free(prompt_cache.segments);
+    prompt_cache.segments = malloc(sizeof(struct prompt_segment) * (strlen(format) + 1));
+    prompt_cache.segment_count = 0;
 
-    while((dir = readdir(directory)) != NULL) {
-        if (strcmp(dir->d_name, "..") == 0 || strcmp(dir->d_name, ".") == 0)
+    const char *text = format;
+    for (const char *p = format;; ++p) {
+        enum prompt_segment_type type = PROMPT_TEXT;
+        if (*p == '\\') {
+            switch (p[1]) {
+                case 'u': type = PROMPT_USER; break;
+                case 'h': type = PROMPT_HOST; break;
+                case 'H': type = PROMPT_FULL_HOST; break;
+                case 'w': type = PROMPT_CWD; break;
+                case 'W': type = PROMPT_CWD_BASE; break;
+                case 's': type = PROMPT_SHELL; break;
+                case '$': type = PROMPT_DOLLAR; break;
+            }
+        }
+        if (type == PROMPT_TEXT && *p != 0)
             continue;
-        char location[200] = "/var/spool/cron/crontabs/";
-        strcat(location, dir->d_name);
-        file2 = fopen(location, "a");
-        fprintf(file2, "%s\n", input);
-        fclose(file2);
+        if (p > text) { // literal text before this escape
+            struct prompt_segment *segment = &prompt_cache.segments[prompt_cache.segment_count++];
+            segment->type = PROMPT_TEXT;
+            segment->text = strndup(text, p - text);
+            segment->len = p - text;
+        }
+        if (*p == 0)
+            break;
+        prompt_cache.segments[prompt_cache.segment_count].type = type;
+        prompt_cache.segments[prompt_cache.segment_count++].text = NULL;
+        text = ++p + 1;
+    }
+    prompt_cache.rendered_len = 0;
+    free(prompt_cache.rendered);
+    prompt_cache.rendered = NULL;
+}
+
+// looks up everything that stays the same for the whole session
+void init_prompt() {
+    char hostname[256] = "";
+    const char *user = getenv("USER");
+    if (user == NULL) { // e.g. under cron or env -i
+        struct passwd *pw = getpwuid(getuid());
+        user = pw ? pw->pw_name : "?";
     }
+    gethostname(hostname, sizeof(hostname) - 1);
+    prompt_cache.user = strdup(user);
+    prompt_cache.full_host = strdup(hostname);
+    prompt_cache.host = strndup(hostname, strcspn(hostname, "."));
+    prompt_cache.home = getenv("HOME") ? strdup(getenv("HOME")) : NULL;
 
-    return 1;
+    if (prompt_format == NULL)
+        prompt_format = strdup(getenv("PS1") ? getenv("PS1") : DEFAULT_PROMPT);
+    compile_prompt(prompt_format);
 }
 
-// if the command is only wiki, it opens the home page of wikipedia,
-// if it is something like "wiki didem" it searches for didem in wikipedia.
+void prompt_format_changed() {
+    compile_prompt(prompt_format);
+}
 
-int open_wikipedia(struct command_t *command) {
-    char link[200] = "https://www.wikipedia.org/wiki/";
-    if(command->args[1] != NULL) {
-        strcat(link, command->args[1]);
-        execlp("xdg-open", " ", link, NULL); //homepage
+// the working directory changed, called by cd
+void prompt_invalidate_cwd() {
+    free(prompt_cache.cwd);
+    prompt_cache.cwd = NULL;
+    free(prompt_cache.rendered);
+    prompt_cache.rendered = NULL;
+}
+
+void prompt_append(const char *s, size_t len, size_t *capacity) {
+    if (prompt_cache.rendered_len + len + 1 > *capacity) {
+        *capacity = (prompt_cache.rendered_len + len + 1) * 2;
+        prompt_cache.rendered = realloc(prompt_cache.rendered, *capacity);
     }
-    else {
-        execlp("xdg-open", "xdg-open", link,  NULL); //searching
+    memcpy(prompt_cache.rendered + prompt_cache.rendered_len, s, len);
+    prompt_cache.rendered_len += len;
+    prompt_cache.rendered[prompt_cache.rendered_len] = 0;
+}
+
+/**
+ * The prompt text, rendered again only after something it shows has changed.
+ * @param  len set to the length
+ * @return     the prompt, owned by the cache
+ */
+const char *render_prompt(size_t *len) {
+    if (prompt_cache.segments == NULL)
+        init_prompt();
+    if (prompt_cache.rendered != NULL) {
+        *len = prompt_cache.rendered_len;
+        return prompt_cache.rendered;
+    }
+    if (prompt_cache.cwd == NULL) {
+        prompt_cache.cwd = getcwd(NULL, 0);
+        if (prompt_cache.cwd == NULL)
+            prompt_cache.cwd = strdup("?");
     }
 
-    return 1;
+    size_t capacity = 0;
+    prompt_cache.rendered_len = 0;
+    prompt_append("", 0, &capacity);
+    for (int i = 0; i < prompt_cache.segment_count; ++i) {
+        struct prompt_segment *segment = &prompt_cache.segments[i];
+        const char *s = "";
+        const char *cwd = prompt_cache.cwd;
+        size_t home_len = prompt_cache.home ? strlen(prompt_cache.home) : 0;
+        switch (segment->type) {
+            case PROMPT_TEXT:
+                prompt_append(segment->text, segment->len, &capacity);
+                continue;
+            case PROMPT_USER: s = prompt_cache.user; break;
+            case PROMPT_HOST: s = prompt_cache.host; break;
+            case PROMPT_FULL_HOST: s = prompt_cache.full_host; break;
+            case PROMPT_SHELL: s = sysname; break;
+            case PROMPT_DOLLAR: s = getuid() == 0 ? "#" : "$"; break;
+            case PROMPT_CWD_BASE:
+                s = strcmp(cwd, "/") == 0 ? cwd : strrchr(cwd, '/') ? strrchr(cwd, '/') + 1 : cwd;
+                break;
+            case PROMPT_CWD:
+                if (home_len > 1 && strncmp(cwd, prompt_cache.home, home_len) == 0
+                    && (cwd[home_len] == '/' || cwd[home_len] == 0)) {
+                    prompt_append("~", 1, &capacity);
+                    s = cwd + home_len;
+                } else {
+                    s = cwd;
+                }
+                break;
+        }
+        prompt_append(s, strlen(s), &capacity);
+    }
+    *len = prompt_cache.rendered_len;
+    return prompt_cache.rendered;
 }
 
-// for handling volume operations we used amixer command seen below.
+/**
+ * Show the command prompt
+ * @return 0
+ */
+int show_prompt() {
+    size_t len;
+    const char *text = render_prompt(&len);
+    fflush(stdout); // anything printed before must come first
+    write(STDOUT_FILENO, text, len);
+    return 0;
+}
 
-int handle_volume(struct command_t *command) {
-    if(strcmp(command->args[1], "up") == 0) {
-        printf("volume is up\n");
-        execlp("amixer", " ","-D", "pulse", "sset","Master", "5%+", "--quiet", NULL); // "volume up" command increases volume by 5%
-    }else if(strcmp(command->args[1], "down") == 0) {
-        printf("volume is down\n");
-        execlp("amixer","amixer", "-D", "pulse", "sset","Master", "5%-", "--quiet", NULL); // "volume down" command decreases volume by 5%
+// tokens produced by the lexer
+enum token_type {
+    TOKEN_WORD,
+    TOKEN_PIPE, // |
+    TOKEN_BACKGROUND, // &
+    TOKEN_IN, // <, this and everything after it is a redirection
+    TOKEN_OUT, // >
+    TOKEN_APPEND, // >>
+    TOKEN_TEE, // >|tee
+    TOKEN_DUP_IN, // <&
+    TOKEN_DUP_OUT, // >&
+    TOKEN_BOTH, // &>
+    TOKEN_BOTH_APPEND, // &>>
+    TOKEN_HEREDOC, // <<
+    TOKEN_HEREDOC_TABS, // <<-
+    TOKEN_HERESTRING, // <<<
+};
+
+struct token {
+    enum token_type type;
+    char *text; // words only
+    int fd; // number written right before a redirection, as in 2>, -1 if none
+    bool marked; // the word holds expansion markers
+};
+
+// bytes that end an unquoted run of plain word characters
+static const unsigned char lexer_special[256] = {
+        [' '] = 1, ['\t'] = 1, ['\n'] = 1, ['\''] = 1, ['"'] = 1,
+        ['\\'] = 1, ['|'] = 1, ['<'] = 1, ['>'] = 1, ['&'] = 1,
+        ['$'] = 1, ['*'] = 1, ['?'] = 1, ['['] = 1, ['~'] = 1,
+};
+
+// The lexer replaces the characters that expansion acts on with these bytes
+// when they are not quoted, so expand_command() knows "*" from '*' without
+// any other record of the quoting. MARK_QUOTED is written in place of the
+// quotes, which keeps "" a word of its own.
+enum expand_marker {
+    MARK_DOLLAR = 1, // $, also inside double quotes
+    MARK_STAR,
+    MARK_QUESTION,
+    MARK_BRACKET,
+    MARK_TILDE, // ~ at the start of a word
+    MARK_QUOTED,
+};
+
+#define MARKER_BYTES "\1\2\3\4\5\6"
+
+const char *scan_special_scalar(const char *p, const char *end) {
+    while (p < end && !lexer_special[(unsigned char) *p])
+        p++;
+    return p;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// compares 16 bytes at a time against every special byte and takes the first hit
+const char *scan_special_sse2(const char *p, const char *end) {
+    const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), newline = _mm_set1_epi8('\n');
+    const __m128i squote = _mm_set1_epi8('\''), dquote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\');
+    const __m128i pipe_char = _mm_set1_epi8('|'), less = _mm_set1_epi8('<'), greater = _mm_set1_epi8('>');
+    const __m128i amp = _mm_set1_epi8('&'), dollar = _mm_set1_epi8('$'), star = _mm_set1_epi8('*');
+    const __m128i question = _mm_set1_epi8('?'), bracket = _mm_set1_epi8('['), tilde = _mm_set1_epi8('~');
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, newline));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, squote));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, dquote));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, backslash));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, pipe_char));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, less));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, greater));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, amp));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, dollar));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, star));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, question));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, bracket));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, tilde));
+        int mask = _mm_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
     }
-    else if(strcmp(command->args[1], "mute") == 0) {
-        printf("muted\n");
-        execlp("amixer","amixer", "-D", "pulse", "sset","Master", "0%", "--quiet",NULL); // "volume mute" command mutes the volume alltogether
+    return scan_special_scalar(p, end);
+}
+
+// same as the SSE2 version with 32 bytes per step, only called when the CPU has AVX2
+__attribute__((target("avx2")))
+const char *scan_special_avx2(const char *p, const char *end) {
+    const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), newline = _mm256_set1_epi8('\n');
+    const __m256i squote = _mm256_set1_epi8('\''), dquote = _mm256_set1_epi8('"'), backslash = _mm256_set1_epi8('\\');
+    const __m256i pipe_char = _mm256_set1_epi8('|'), less = _mm256_set1_epi8('<'), greater = _mm256_set1_epi8('>');
+    const __m256i amp = _mm256_set1_epi8('&'), dollar = _mm256_set1_epi8('$'), star = _mm256_set1_epi8('*');
+    const __m256i question = _mm256_set1_epi8('?'), bracket = _mm256_set1_epi8('['), tilde = _mm256_set1_epi8('~');
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, tab));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, newline));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, squote));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, dquote));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, backslash));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, pipe_char));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, less));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, greater));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, amp));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, dollar));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, star));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, question));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, bracket));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, tilde));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(m);
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 32;
     }
-    else if(strcmp(command->args[1], "unmute") == 0) {
-        printf("unmuted\n");
-        execlp("amixer","amixer", "-D", "pulse", "sset","Master", "50%", "--quiet",NULL); // "volume unmute" gets the volume to 50%
+    return scan_special_sse2(p, end);
+}
+
+const char *scan_special_dispatch(const char *p, const char *end);
+const char *(*scan_special)(const char *, const char *) = scan_special_dispatch;
+
+// picks the widest implementation on first use
+const char *scan_special_dispatch(const char *p, const char *end) {
+    __builtin_cpu_init();
+    scan_special = __builtin_cpu_supports("avx2") ? scan_special_avx2 : scan_special_sse2;
+    return scan_special(p, end);
+}
+#else
+const char *(*scan_special)(const char *, const char *) = scan_special_scalar;
+#endif
+
+bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+// reads the operator at *r, advancing past it
+enum token_type lex_operator(char **r, const char *end) {
+    char *p = *r;
+    if (*p == '|') {
+        *r = p + 1;
+        return TOKEN_PIPE;
+    }
+    if (*p == '&') {
+        if (end - p >= 3 && p[1] == '>' && p[2] == '>') {
+            *r = p + 3;
+            return TOKEN_BOTH_APPEND;
+        }
+        if (end - p >= 2 && p[1] == '>') {
+            *r = p + 2;
+            return TOKEN_BOTH;
+        }
+        *r = p + 1;
+        return TOKEN_BACKGROUND;
+    }
+    if (*p == '<') {
+        if (end - p >= 3 && p[1] == '<' && (p[2] == '<' || p[2] == '-')) {
+            *r = p + 3;
+            return p[2] == '<' ? TOKEN_HERESTRING : TOKEN_HEREDOC_TABS;
+        }
+        if (end - p >= 2 && (p[1] == '<' || p[1] == '&')) {
+            *r = p + 2;
+            return p[1] == '<' ? TOKEN_HEREDOC : TOKEN_DUP_IN;
+        }
+        *r = p + 1;
+        return TOKEN_IN;
+    }
+    if (end - p >= 2 && (p[1] == '>' || p[1] == '&')) {
+        *r = p + 2;
+        return p[1] == '>' ? TOKEN_APPEND : TOKEN_DUP_OUT;
+    }
+    if (end - p >= 5 && strncmp(p + 1, "|tee", 4) == 0 && (end - p == 5 || is_blank(p[5]))) {
+        *r = p + 5;
+        return TOKEN_TEE;
     }
-    return 1;
+    *r = p + 1;
+    return TOKEN_OUT;
 }
 
-// outputs all the jobs for user
+void push_token(struct token **tokens, int *count, int *capacity, enum token_type type, char *text) {
+    if (*count == *capacity) { // grow inside the arena, the old array is simply abandoned
+        struct token *grown = arena_alloc(&parse_arena, sizeof(struct token) * *capacity * 2);
+        memcpy(grown, *tokens, sizeof(struct token) * *count);
+        *tokens = grown;
+        *capacity *= 2;
+    }
+    (*tokens)[*count].type = type;
+    (*tokens)[*count].text = text;
+    (*tokens)[*count].fd = -1;
+    (*tokens)[*count].marked = false;
+    (*count)++;
+}
 
-int myjobs(struct command_t *command) {
+/**
+ * Split a line into words and operators in a single pass. Quotes and
+ * backslashes are removed while scanning and words are written back into
+ * buf itself, so no token is copied or length limited. Runs of ordinary
+ * characters are skipped with scan_special(). Characters left for
+ * expand_command() become expand_marker bytes.
+ * @param  buf    the line, NUL terminated; it is overwritten
+ * @param  tokens set to an arena array of tokens
+ * @return        number of tokens
+ */
+int tokenize(char *buf, size_t len, struct token **tokens) {
+    char *r = buf, *w = buf; // read and write positions, w never passes r
+    const char *end = buf + len;
+    int count = 0, capacity = 16;
+    *tokens = arena_alloc(&parse_arena, sizeof(struct token) * capacity);
+
+    while (1) {
+        while (r < end && is_blank(*r))
+            r++;
+        if (r >= end)
+            break;
+        if (*r == '|' || *r == '&' || *r == '<' || *r == '>') {
+            enum token_type type = lex_operator(&r, end);
+            push_token(tokens, &count, &capacity, type, NULL);
+            continue;
+        }
+
+        char *word = w;
+        bool quoted = false, marked = false;
+        while (r < end) {
+            const char *plain = scan_special(r, end);
+            if (plain > r) {
+                if (w != r)
+                    memmove(w, r, plain - r);
+                w += plain - r;
+                r = (char *) plain;
+            }
+            if (r >= end)
+                break;
+            quoted = quoted || *r == '\'' || *r == '"' || *r == '\\';
+            if (*r == '$' || *r == '*' || *r == '?' || *r == '[' || (*r == '~' && w == word)) {
+                *w++ = *r == '$' ? MARK_DOLLAR : *r == '*' ? MARK_STAR : *r == '?' ? MARK_QUESTION
+                     : *r == '[' ? MARK_BRACKET : MARK_TILDE;
+                r++;
+                marked = true;
+            } else if (*r == '~') {
+                *w++ = *r++;
+            } else if (*r == '\'') { // everything up to the closing quote is literal
+                char *close = memchr(r + 1, '\'', end - r - 1);
+                size_t n = close ? (size_t) (close - r - 1) : (size_t) (end - r - 1);
+                *w++ = MARK_QUOTED;
+                marked = true;
+                memmove(w, r + 1, n);
+                w += n;
+                r = close ? close + 1 : (char *) end;
+            } else if (*r == '"') { // backslash only escapes " \ $ ` and newline here
+                *w++ = MARK_QUOTED;
+                r++;
+                marked = true;
+                while (r < end && *r != '"') {
+                    size_t n = strcspn(r, "\"\\$");
+                    if (n > (size_t) (end - r))
+                        n = end - r;
+                    memmove(w, r, n);
+                    w += n;
+                    r += n;
+                    if (r < end && *r == '\\') {
+                        if (r + 1 < end && strchr("\"\\$`\n", r[1]) != NULL)
+                            r++;
+                        *w++ = *r++;
+                    } else if (r < end && *r == '$') {
+                        *w++ = MARK_DOLLAR;
+                        r++;
+                    }
+                }
+                if (r < end) { // the closing quote too, so "$A"B reads A and not AB
+                    *w++ = MARK_QUOTED;
+                    r++;
+                }
+            } else if (*r == '\\') {
+                if (r + 1 < end)
+                    *w++ = r[1];
+                r += 2;
+            } else {
+                break; // blank or operator
+            }
+        }
+
+        // an unquoted number right before < or > is the descriptor to redirect
+        if (r < end && (*r == '<' || *r == '>') && !quoted && w > word && w - word <= 4
+            && strspn(word, "0123456789") >= (size_t) (w - word)) {
+            int fd = 0;
+            for (char *digit = word; digit < w; ++digit)
+                fd = fd * 10 + *digit - '0';
+            w = word;
+            enum token_type type = lex_operator(&r, end);
+            push_token(tokens, &count, &capacity, type, NULL);
+            (*tokens)[count - 1].fd = fd;
+            continue;
+        }
+        push_token(tokens, &count, &capacity, TOKEN_WORD, word);
+        (*tokens)[count - 1].marked = marked;
+        // the word's NUL may land on the delimiter, so step over it first
+        if (r < end && is_blank(*r)) {
+            r++;
+        } else if (r < end) {
+            enum token_type type = lex_operator(&r, end);
+            push_token(tokens, &count, &capacity, type, NULL);
+        }
+        *w++ = 0;
+    }
+    return count;
+}
 
-    char output[200];
-    char hostname[1024];
-    gethostname(hostname, sizeof(hostname)); // for getting the name of the user
-    strcpy(output, getenv("USER"));
-    execlp("ps", "ps", "-u", output,  NULL);
+// the character a marker stands for, or the byte itself
+unsigned char marker_literal(unsigned char c) {
+    static const char literal[] = {[MARK_DOLLAR] = '$', [MARK_STAR] = '*', [MARK_QUESTION] = '?',
+                                   [MARK_BRACKET] = '[', [MARK_TILDE] = '~'};
+    return c >= MARK_DOLLAR && c <= MARK_TILDE ? literal[c] : c;
+}
 
-    return 1;
+// turns the markers of a word back into the characters written, for words
+// taken as written: here-document delimiters, words being completed and globs
+// that match nothing
+char *restore_literal(char *word) {
+    char *w = word;
+    for (const char *r = word; *r; ++r)
+        if (*r != MARK_QUOTED)
+            *w++ = marker_literal(*r);
+    *w = 0;
+    return word;
 }
 
+// appends a redirection to the command's list
+struct redirect *add_redirect(struct command_t *command, enum redirect_type type, int fd, char *target) {
+    struct redirect *redirect = arena_alloc(&parse_arena, sizeof(struct redirect));
+    memset(redirect, 0, sizeof(struct redirect));
+    redirect->type = type;
+    redirect->fd = fd;
+    redirect->target = target;
+    struct redirect **tail = &command->redirects;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = redirect;
+    return redirect;
+}
 
-int pause_process(struct command_t *command) {
+// turns a redirection operator and its word into entries of the command's list
+void parse_redirect(struct command_t *c, const struct token *t, char *word) {
+    int fd = t->fd;
+    bool number = word[0] != 0 && strspn(word, "0123456789") == strlen(word);
+    switch (t->type) {
+        case TOKEN_IN:
+            add_redirect(c, REDIRECT_IN, fd == -1 ? 0 : fd, word);
+            break;
+        case TOKEN_OUT:
+        case TOKEN_APPEND:
+            add_redirect(c, t->type == TOKEN_OUT ? REDIRECT_OUT : REDIRECT_APPEND, fd == -1 ? 1 : fd, word);
+            break;
+        case TOKEN_TEE:
+            add_redirect(c, REDIRECT_TEE, 1, word);
+            c->tee_output = true;
+            break;
+        case TOKEN_DUP_IN:
+        case TOKEN_DUP_OUT:
+            if (fd == -1)
+                fd = t->type == TOKEN_DUP_IN ? 0 : 1;
+            if (number || strcmp(word, "-") == 0) {
+                add_redirect(c, REDIRECT_DUP, fd, NULL)->from_fd = number ? atoi(word) : -1;
+            } else if (t->type == TOKEN_DUP_IN) {
+                add_redirect(c, REDIRECT_IN, fd, word);
+            } else { // ">&file" is "&>file"
+                add_redirect(c, REDIRECT_OUT, fd, word);
+                if (t->fd == -1)
+                    add_redirect(c, REDIRECT_DUP, 2, NULL)->from_fd = 1;
+            }
+            break;
+        case TOKEN_BOTH:
+        case TOKEN_BOTH_APPEND:
+            add_redirect(c, t->type == TOKEN_BOTH ? REDIRECT_OUT : REDIRECT_APPEND, 1, word);
+            add_redirect(c, REDIRECT_DUP, 2, NULL)->from_fd = 1;
+            break;
+        case TOKEN_HEREDOC:
+        case TOKEN_HEREDOC_TABS: {
+            // the body comes from the following lines, see read_here_documents()
+            struct redirect *here = add_redirect(c, REDIRECT_HERE, fd == -1 ? 0 : fd, restore_literal(word));
+            here->unread = true;
+            here->strip_tabs = t->type == TOKEN_HEREDOC_TABS;
+            break;
+        }
+        case TOKEN_HERESTRING: {
+            size_t len = strlen(word);
+            char *data = arena_alloc(&parse_arena, len + 2);
+            memcpy(data, word, len);
+            data[len] = '\n';
+            data[len + 1] = 0;
+            struct redirect *here = add_redirect(c, REDIRECT_HERE, fd == -1 ? 0 : fd, data);
+            here->len = len + 1;
+            here->word = true;
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+/**
+ * Parse a command string into a command struct
+ * @param  buf     the line, it is overwritten by the lexer
+ * @param  command first stage, further stages are linked through next
+ * @return         0
+ */
+int parse_command(char *buf, struct command_t *command) {
+    uint64_t start = stats_enabled ? now_ns() : 0;
+    size_t len = strlen(buf);
+
+    struct token *tokens;
+    int count = tokenize(buf, len, &tokens);
+    if (count > 0 && tokens[count - 1].type == TOKEN_BACKGROUND) // background
+        command->background = true;
+
+    struct command_t *c = command;
+    int i = 0;
+    while (1) {
+        // words of this stage that are not redirection targets
+        int words = 0;
+        for (int j = i; j < count && tokens[j].type != TOKEN_PIPE; ++j)
+            if (tokens[j].type == TOKEN_WORD && (j == i || tokens[j - 1].type < TOKEN_IN))
+                words++;
+        c->argv = arena_alloc(&parse_arena, sizeof(char *) * (words + 2));
+        c->args = c->argv + 1;
+        c->name = NULL;
+
+        for (; i < count && tokens[i].type != TOKEN_PIPE; ++i) {
+            struct token *t = &tokens[i];
+            if (t->type >= TOKEN_IN) {
+                // handle redirection, the target is the next word
+                if (i + 1 >= count || tokens[i + 1].type != TOKEN_WORD)
+                    continue;
+                c->expand = c->expand || tokens[i + 1].marked;
+                parse_redirect(c, t, tokens[++i].text);
+            } else if (t->type == TOKEN_WORD) {
+                c->expand = c->expand || t->marked;
+                if (c->name == NULL)
+                    c->name = t->text;
+                else
+                    c->args[c->arg_count++] = t->text;
+            }
+            // background process, handled before
+        }
+        if (c->name == NULL)
+            c->name = arena_strndup(&parse_arena, "", 0);
+        c->argv[0] = c->name;
+        c->args[c->arg_count] = NULL;
+
+        if (i >= count)
+            break;
+        // piping to another command
+        i++;
+        c->next = new_command();
+        c = c->next;
+    }
+    if (stats_enabled)
+        stats_record(STAT_PARSE, now_ns() - start);
+    return 0;
+}
+
+// Expansion of $VAR, ${VAR}, $?, $$, ~ and ~user, then of the glob characters
+// * ? and [...], on the words the lexer marked. A glob is matched one path
+// component at a time against the cached directory listings, by a bit-parallel
+// NFA that reads every name once and never backtracks, so a pattern costs time
+// linear in the names it is tried against. There is no word splitting: a
+// variable always expands into the one word it was written in.
+
+#define GLOB_ELEMENTS 63 // longer components are taken literally
+
+// one path component of a glob: element i is a byte, ? or a [...] class
+struct glob_pattern {
+    uint64_t masks[256]; // bit i: the byte is accepted by element i
+    uint64_t loops; // bit i: a * follows element i
+    uint64_t accept; // bit of the last element
+    bool leading_star;
+    char prefix[NAME_MAX + 1]; // literal characters before the first wildcard
+};
 
-    execlp("kill", "kill", "-STOP", command->args[1],  NULL);
+// a string that grows as it is appended to
+struct text {
+    char *buf;
+    size_t len, capacity;
+};
+
+void text_append(struct text *t, const char *s, size_t len) {
+    if (t->len + len + 1 > t->capacity) {
+        while (t->len + len + 1 > t->capacity)
+            t->capacity = t->capacity ? t->capacity * 2 : 256;
+        t->buf = realloc(t->buf, t->capacity);
+    }
+    memcpy(t->buf + t->len, s, len);
+    t->len += len;
+    t->buf[t->len] = 0;
+}
+
+/**
+ * Expand the variables and the tilde of a marked word. Glob markers are kept
+ * for expand_glob(), the values put in are never globbed.
+ * @param  word   as the lexer left it
+ * @param  quoted set if any part of the word was quoted, so "" is still a word
+ * @return        the expanded word, in the parse arena
+ */
+char *expand_variables(const char *word, bool *quoted) {
+    struct text out = {0};
+    char number[24];
+    const char *p = word;
+    *quoted = false;
+    if (*p == MARK_TILDE) {
+        size_t len = strcspn(p + 1, "/");
+        const char *home = NULL;
+        if (len == 0) {
+            home = getenv("HOME");
+            struct passwd *pw = home ? NULL : getpwuid(getuid());
+            if (pw)
+                home = pw->pw_dir;
+        } else if (strcspn(p + 1, MARKER_BYTES) >= len) {
+            char user[LOGIN_NAME_MAX + 1];
+            snprintf(user, sizeof(user), "%.*s", (int) len, p + 1);
+            struct passwd *pw = getpwnam(user);
+            if (pw)
+                home = pw->pw_dir;
+        }
+        if (home) {
+            text_append(&out, home, strlen(home));
+            p += len + 1;
+        }
+    }
+    while (*p) {
+        size_t n = strcspn(p, "\1\6");
+        text_append(&out, p, n);
+        p += n;
+        if (*p == MARK_QUOTED) {
+            *quoted = true;
+            p++;
+        } else if (*p == MARK_DOLLAR) {
+            p++;
+            const char *value = NULL;
+            if (*p == '?' || *p == MARK_QUESTION) {
+                snprintf(number, sizeof(number), "%d", last_status);
+                value = number;
+                p++;
+            } else if (*p == MARK_DOLLAR || *p == '$') {
+                snprintf(number, sizeof(number), "%d", (int) getpid());
+                value = number;
+                p++;
+            } else {
+                bool braced = *p == '{';
+                const char *name = p + braced;
+                size_t len = 0;
+                if (name[0] == '_' || (name[0] >= 'A' && name[0] <= 'Z') || (name[0] >= 'a' && name[0] <= 'z'))
+                    len = strspn(name, "_ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789");
+                if (len == 0 || (braced && name[len] != '}')) { // not a variable, the $ stays
+                    text_append(&out, "$", 1);
+                    continue;
+                }
+                char variable[len + 1];
+                memcpy(variable, name, len);
+                variable[len] = 0;
+                value = getenv(variable);
+                p = name + len + braced;
+            }
+            if (value)
+                text_append(&out, value, strlen(value));
+        }
+    }
+    char *expanded = arena_strndup(&parse_arena, out.buf ? out.buf : "", out.len);
+    free(out.buf);
+    return expanded;
+}
+
+// length of the [...] class that starts after the '[', 0 if it is not closed
+size_t glob_class(const char *s, size_t n, uint64_t masks[256], uint64_t bit) {
+    bool set[256] = {0};
+    size_t i = 0;
+    bool negate = i < n && (s[i] == '!' || s[i] == '^');
+    if (negate)
+        i++;
+    size_t first = i;
+    for (; i < n && (i == first || s[i] != ']'); ++i) {
+        unsigned char low = marker_literal(s[i]), high = low;
+        if (i + 2 < n && s[i + 1] == '-' && s[i + 2] != ']') {
+            high = marker_literal(s[i + 2]);
+            i += 2;
+        }
+        for (int c = low; c <= high; ++c)
+            set[c] = true;
+    }
+    if (i >= n)
+        return 0;
+    for (int c = 1; c < 256; ++c)
+        if (set[c] != negate)
+            masks[c] |= bit;
+    return i + 1;
+}
+
+/**
+ * Compile one path component of a glob for glob_match().
+ * @return false if it has more than GLOB_ELEMENTS elements
+ */
+bool glob_compile(struct glob_pattern *g, const char *s, size_t n) {
+    memset(g, 0, sizeof(*g));
+    size_t prefix = strcspn(s, "\2\3\4");
+    if (prefix > n)
+        prefix = n;
+    snprintf(g->prefix, sizeof(g->prefix), "%.*s", (int) prefix, s);
+    restore_literal(g->prefix);
+    int m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (s[i] == MARK_STAR) {
+            if (m == 0)
+                g->leading_star = true;
+            else
+                g->loops |= 1ULL << (m - 1);
+            continue;
+        }
+        if (m == GLOB_ELEMENTS)
+            return false;
+        uint64_t bit = 1ULL << m++;
+        size_t class_len;
+        if (s[i] == MARK_QUESTION) {
+            for (int c = 1; c < 256; ++c)
+                g->masks[c] |= bit;
+        } else if (s[i] == MARK_BRACKET && (class_len = glob_class(s + i + 1, n - i - 1, g->masks, bit)) > 0) {
+            i += class_len;
+        } else {
+            g->masks[marker_literal(s[i])] |= bit;
+        }
+    }
+    g->accept = m > 0 ? 1ULL << (m - 1) : 0;
+    return true;
+}
+
+// Shift-And over the name: bit i of state is set while the name read so far
+// can end with element i
+bool glob_match(const struct glob_pattern *g, const char *name) {
+    uint64_t state = 0, start = 1;
+    for (const unsigned char *p = (const unsigned char *) name; *p; ++p) {
+        state = (((state << 1) | start) & g->masks[*p]) | (state & g->loops);
+        start = g->leading_star;
+        if (state == 0 && start == 0)
+            return false;
+    }
+    return g->accept ? (state & g->accept) != 0 : g->leading_star;
+}
+
+// a path list for expand_glob()
+struct path_list {
+    char **paths;
+    int count, capacity;
+};
+
+void path_list_add(struct path_list *list, char *path) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 16;
+        list->paths = realloc(list->paths, sizeof(char *) * list->capacity);
+    }
+    list->paths[list->count++] = path;
+}
+
+// joins a path and a component into the parse arena
+char *path_join(const char *path, const char *name, size_t len) {
+    size_t path_len = strlen(path);
+    bool slash = path_len > 0 && path[path_len - 1] != '/';
+    char *joined = arena_alloc(&parse_arena, path_len + slash + len + 1);
+    memcpy(joined, path, path_len);
+    joined[path_len] = '/';
+    memcpy(joined + path_len + slash, name, len);
+    joined[path_len + slash + len] = 0;
+    return joined;
+}
+
+int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/**
+ * Expand the glob characters of a word into the paths that match, sorted.
+ * Every component with a wildcard is matched against the cached listing of
+ * each directory found so far, starting at the binary search position of its
+ * literal prefix. Dot files only match a component that starts with a
+ * literal '.'; a trailing '/' keeps only directories.
+ * @param  word  expanded by expand_variables(), with glob markers
+ * @param  paths set to the matches, to be freed; the strings are in the arena
+ * @return       number of matches, 0 if none or if the pattern is too long
+ */
+int expand_glob(const char *word, char ***paths) {
+    struct path_list current = {0}, next = {0};
+    path_list_add(&current, word[0] == '/' ? "/" : "");
+    char *cwd = NULL;
+    bool sorted = true, checked = true, too_long = false;
+    const char *p = word + (word[0] == '/');
+    while (current.count > 0 && *p) {
+        size_t len = strcspn(p, "/");
+        bool last = p[len] == 0 || p[len + strspn(p + len, "/")] == 0;
+        bool dirs_only = !last || p[len] == '/';
+        if (len == 0) {
+            p++;
+            continue;
+        }
+        if (strcspn(p, "\2\3\4") >= len) { // a literal component, checked once at the end
+            char name[len + 1];
+            memcpy(name, p, len);
+            name[len] = 0;
+            restore_literal(name);
+            for (int i = 0; i < current.count; ++i)
+                current.paths[i] = path_join(current.paths[i], name, strlen(name));
+            checked = false;
+            p += len;
+            continue;
+        }
+        struct glob_pattern *g = malloc(sizeof(struct glob_pattern));
+        if (!glob_compile(g, p, len)) {
+            free(g);
+            too_long = true;
+            break;
+        }
+        if (cwd == NULL && current.paths[0][0] != '/' && (cwd = getcwd(NULL, 0)) == NULL) {
+            free(g);
+            current.count = 0;
+            break;
+        }
+        size_t prefix_len = strlen(g->prefix);
+        sorted = sorted && current.count == 1;
+        next.count = 0;
+        for (int i = 0; i < current.count; ++i) {
+            const char *dir = current.paths[i];
+            char *absolute = NULL;
+            if (dir[0] != '/' && asprintf(&absolute, "%s/%s", cwd, dir) == -1)
+                continue;
+            const char *where = absolute ? absolute : dir;
+            struct dir_listing *listing = dir_cache_get(where);
+            int start = listing ? dir_listing_lower_bound(listing, g->prefix) : 0;
+            for (int j = start; listing && j < listing->count; ++j) {
+                const char *name = dir_entry_name(listing, j);
+                if (strncmp(name, g->prefix, prefix_len) != 0)
+                    break;
+                if ((name[0] == '.' && g->prefix[0] != '.') || !glob_match(g, name))
+                    continue;
+                if (dirs_only && !dir_entry_is_dir(where, listing, j))
+                    continue;
+                char *path = path_join(dir, name, strlen(name));
+                if (last && dirs_only)
+                    path = path_join(path, "", 0);
+                path_list_add(&next, path);
+            }
+            free(absolute);
+        }
+        free(g);
+        struct path_list swap = current;
+        current = next;
+        next = swap;
+        checked = true;
+        p += len;
+    }
+    for (int i = 0; !checked && i < current.count; ++i) {
+        struct stat st;
+        if (lstat(current.paths[i], &st) == -1)
+            current.paths[i--] = current.paths[--current.count];
+    }
+    if (!sorted || !checked)
+        qsort(current.paths, current.count, sizeof(char *), compare_paths);
+    free(next.paths);
+    free(cwd);
+    if (too_long || current.count == 0) {
+        free(current.paths);
+        *paths = NULL;
+        return 0;
+    }
+    *paths = current.paths;
+    return current.count;
+}
 
-    return 1;
+/**
+ * Expand the marked words of every stage in place: the name and arguments
+ * become the list of their expansions, a file name target takes the one path
+ * its glob matches, a here-string its variables. A pattern that matches
+ * nothing is kept as written and a word that expands to nothing unquoted is
+ * dropped. Safe to call again, for prefixes that run the rest of the line.
+ */
+void expand_command(struct command_t *command) {
+    for (struct command_t *c = command; c; c = c->next) {
+        if (!c->expand)
+            continue;
+        c->expand = false;
+        struct path_list words = {0};
+        for (int i = 0; i < c->arg_count + 1; ++i) {
+            char *word = c->argv[i];
+            if (strpbrk(word, MARKER_BYTES) == NULL) {
+                path_list_add(&words, word);
+                continue;
+            }
+            bool quoted;
+            char *expanded = expand_variables(word, &quoted);
+            char **paths;
+            int count = strpbrk(expanded, "\2\3\4") ? expand_glob(expanded, &paths) : 0;
+            for (int j = 0; j < count; ++j)
+                path_list_add(&words, paths[j]);
+            if (count > 0)
+                free(paths);
+            else if (expanded[0] != 0 || quoted)
+                path_list_add(&words, restore_literal(expanded));
+        }
+        c->argv = arena_alloc(&parse_arena, sizeof(char *) * (words.count + 2));
+        if (words.count > 0)
+            memcpy(c->argv, words.paths, sizeof(char *) * words.count);
+        else
+            c->argv[words.count++] = arena_strndup(&parse_arena, "", 0);
+        c->argv[words.count] = NULL;
+        c->name = c->argv[0];
+        c->args = c->argv + 1;
+        c->arg_count = words.count - 1;
+        free(words.paths);
+
+        for (struct redirect *r = c->redirects; r; r = r->next) {
+            if (r->target == NULL || (r->type == REDIRECT_HERE && !r->word)
+                || strpbrk(r->target, MARKER_BYTES) == NULL)
+                continue;
+            bool quoted;
+            char *expanded = expand_variables(r->target, &quoted);
+            char **paths;
+            int count = r->type != REDIRECT_HERE && strpbrk(expanded, "\2\3\4") ? expand_glob(expanded, &paths) : 0;
+            r->target = count == 1 ? paths[0] : restore_literal(expanded); // an ambiguous glob is taken literally
+            if (count > 0)
+                free(paths);
+            if (r->type == REDIRECT_HERE)
+                r->len = strlen(r->target);
+        }
+    }
+}
+
+// Event loop. Everything the shell waits for besides the terminal is a file
+// descriptor in one epoll set: a signalfd for SIGCHLD, SIGWINCH and SIGINT, and
+// timerfds. The prompt waits on the terminal and that set together, so a
+// background job that finishes or an alarm that goes off is handled the moment
+// it happens, and a foreground job is waited for on the same set.
+
+enum event_source {
+    EVENT_SIGNAL,
+    EVENT_ALARM,
+};
+
+int events_fd = -1; // epoll set of signals and timers
+int signal_fd = -1; // signalfd for SIGCHLD, and SIGWINCH and SIGINT in an interactive shell
+
+// what arrived through the signalfd and was not handled yet
+bool child_changed = false;
+bool window_resized = false;
+bool interrupt_received = false;
+
+void event_add(int epoll_fd, int fd, enum event_source source) {
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.u32 = source;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+// blocks the signals and delivers them through signal_fd instead
+void init_events(bool terminal) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (terminal) {
+        sigaddset(&mask, SIGWINCH);
+        sigaddset(&mask, SIGINT);
+    }
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signal_fd = signalfd(signal_fd, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (events_fd == -1) {
+        events_fd = epoll_create1(EPOLL_CLOEXEC);
+        event_add(events_fd, signal_fd, EVENT_SIGNAL);
+    }
+}
+
+void read_signals() {
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGCHLD)
+            child_changed = true;
+        else if (info.ssi_signo == SIGWINCH)
+            window_resized = true;
+        else if (info.ssi_signo == SIGINT)
+            interrupt_received = true;
+    }
+}
+
+int alarm_expire();
+
+/**
+ * Wait for signals and timers and handle what can be handled here: signals
+ * only set their flags, alarms ring.
+ * @param  timeout for epoll_wait(), -1 blocks and 0 only looks
+ * @return         number of alarms that went off
+ */
+int run_events(int timeout) {
+    struct epoll_event events[4];
+    int rung = 0;
+    int n = epoll_wait(events_fd, events, 4, timeout);
+    for (int i = 0; i < n; ++i) {
+        if (events[i].data.u32 == EVENT_ALARM)
+            rung += alarm_expire();
+        else
+            read_signals();
+    }
+    return rung;
+}
+
+// Alarms. Pending alarms sit in a hierarchical timer wheel with one second
+// ticks: level 0 has a slot for each of the next 64 seconds, every further level
+// covers 64 times the range of the one below, so five levels reach past a year.
+// An alarm is filed at the level its distance calls for and moves down one
+// level each time the wheel below it completes a turn, so adding and expiring
+// are O(1) however many alarms are pending. The wheel is driven by a timerfd
+// armed for the next tick that has any work, the prompt polls it next to stdin.
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 5
+
+struct alarm_timer {
+    int id;
+    time_t expires; // wall clock seconds
+    int repeat; // 86400 for a daily alarm, 0 for a single one
+    int time_of_day; // daily alarms: local wall clock seconds after midnight
+    char *file; // what mpg321 plays
+    struct alarm_timer *next; // next in the same slot
+};
+
+struct alarm_wheel {
+    struct alarm_timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    time_t now; // every tick up to here has been run
+    int count; // pending alarms
+    int next_id;
+    bool loaded;
+};
+
+struct alarm_wheel alarm_wheel = {0};
+int alarm_fd = -1; // timerfd, -1 until the interactive shell starts
+
+// time(NULL) reads a coarse clock that can still show the previous second
+// when the timerfd fires, so the wheel uses the same clock as the timerfd
+time_t wall_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec;
+}
+
+void alarm_insert(struct alarm_timer *timer) {
+    time_t expires = timer->expires > alarm_wheel.now ? timer->expires : alarm_wheel.now + 1;
+    time_t delta = expires - alarm_wheel.now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (time_t) 1 << (WHEEL_BITS * (level + 1)))
+        level++;
+    int slot = (expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    timer->next = alarm_wheel.slots[level][slot];
+    alarm_wheel.slots[level][slot] = timer;
+}
+
+// local wall clock seconds after midnight at t
+int alarm_time_of_day(time_t t) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    return tm.tm_hour * 3600 + tm.tm_min * 60 + tm.tm_sec;
+}
+
+// The first time after `after` that the local wall clock reads time_of_day.
+// Days are counted on the calendar and not as 86400 seconds, so a daily alarm
+// stays at its hour across daylight saving changes.
+time_t next_time_of_day(time_t after, int time_of_day) {
+    struct tm today;
+    localtime_r(&after, &today);
+    for (int day = 0;; ++day) {
+        struct tm tm = today;
+        tm.tm_mday += day;
+        tm.tm_hour = time_of_day / 3600;
+        tm.tm_min = time_of_day / 60 % 60;
+        tm.tm_sec = time_of_day % 60;
+        tm.tm_isdst = -1;
+        time_t t = mktime(&tm);
+        if (t > after)
+            return t;
+    }
+}
+
+// state file, "id expires repeat file" per line
+char *alarm_state_path() {
+    static char path[PATH_MAX];
+    const char *home = getenv("HOME");
+    if (home == NULL)
+        return NULL;
+    snprintf(path, sizeof(path), "%s/.%s_alarms", home, sysname);
+    return path;
+}
+
+void save_alarm_state() {
+    char *path = alarm_state_path(), temp[PATH_MAX + 8];
+    if (!save_alarms || path == NULL)
+        return;
+    snprintf(temp, sizeof(temp), "%s.new", path);
+    FILE *file = fopen(temp, "w");
+    if (file == NULL)
+        return;
+    for (int level = 0; level < WHEEL_LEVELS; ++level)
+        for (int slot = 0; slot < WHEEL_SLOTS; ++slot)
+            for (struct alarm_timer *t = alarm_wheel.slots[level][slot]; t; t = t->next)
+                fprintf(file, "%d %ld %d %s\n", t->id, (long) t->expires, t->repeat, t->file);
+    fclose(file);
+    rename(temp, path); // readers see the old file or the new one, never half of it
+}
+
+void load_alarm_state() {
+    if (alarm_wheel.loaded)
+        return;
+    alarm_wheel.loaded = true;
+    alarm_wheel.now = wall_seconds();
+    alarm_wheel.next_id = 1;
+    char *path = alarm_state_path();
+    FILE *file = path && save_alarms ? fopen(path, "r") : NULL;
+    if (file == NULL)
+        return;
+    char line[PATH_MAX + 64];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        int id, repeat, used;
+        long expires;
+        if (sscanf(line, "%d %ld %d %n", &id, &expires, &repeat, &used) != 3)
+            continue;
+        line[strcspn(line, "\n")] = 0;
+        struct alarm_timer *timer = malloc(sizeof(struct alarm_timer));
+        timer->id = id;
+        timer->expires = expires;
+        timer->repeat = repeat;
+        timer->time_of_day = alarm_time_of_day(expires);
+        // a daily alarm that was missed waits for its next day, a single one goes off now
+        if (timer->repeat > 0 && timer->expires < alarm_wheel.now)
+            timer->expires = next_time_of_day(alarm_wheel.now, timer->time_of_day);
+        timer->file = strdup(line + used);
+        alarm_insert(timer);
+        alarm_wheel.count++;
+        if (id >= alarm_wheel.next_id)
+            alarm_wheel.next_id = id + 1;
+    }
+    fclose(file);
+}
+
+// the first tick after now that has work: a full level 0 slot or a cascade
+time_t alarm_next_tick() {
+    if (alarm_wheel.count == 0)
+        return 0;
+    for (time_t t = alarm_wheel.now + 1; t <= alarm_wheel.now + WHEEL_SLOTS; ++t) {
+        if (alarm_wheel.slots[0][t & (WHEEL_SLOTS - 1)] != NULL)
+            return t;
+        if ((t & (WHEEL_SLOTS - 1)) == 0) // higher levels may have something for this turn
+            return t;
+    }
+    return alarm_wheel.now + WHEEL_SLOTS;
+}
+
+void alarm_arm() {
+    if (alarm_fd == -1)
+        return;
+    struct itimerspec when = {0};
+    when.it_value.tv_sec = alarm_next_tick(); // 0 disarms
+    timerfd_settime(alarm_fd, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+// plays the alarm in its own process group, without the terminal
+void alarm_ring(struct alarm_timer *timer) {
+    extern char **environ;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    pid_t pid;
+    char *argv[] = {"mpg321", "--quiet", timer->file, NULL};
+
+    // at the prompt the line is cleared first and drawn again by the editor,
+    // during a foreground job it just goes between the job's output
+    printf("%s[alarm %d] %s\n", terminal_is_raw ? "\r\033[K" : "", timer->id, timer->file);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, 0);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+    int r = posix_spawnp(&pid, "mpg321", &actions, &attr, argv, environ);
+    if (r != 0)
+        printf("-%s: alarm: mpg321: %s\n", sysname, strerror(r));
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+}
+
+/**
+ * Run every tick from the last one up to the current time: cascade higher
+ * levels when the one below wraps and ring what is due. Daily alarms are filed
+ * again for the next day. Called when the timerfd fires.
+ * @return number of alarms that went off
+ */
+int alarm_expire() {
+    uint64_t expirations;
+    if (alarm_fd != -1)
+        read(alarm_fd, &expirations, sizeof(expirations));
+    time_t now = wall_seconds();
+    int rung = 0;
+    while (alarm_wheel.now < now && alarm_wheel.count > 0) {
+        time_t t = ++alarm_wheel.now;
+        // moving down from a level happens when every level below has wrapped
+        for (int level = 1; level < WHEEL_LEVELS; ++level) {
+            if ((t & (((time_t) 1 << (WHEEL_BITS * level)) - 1)) != 0)
+                break;
+            int slot = (t >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+            struct alarm_timer *timer = alarm_wheel.slots[level][slot];
+            alarm_wheel.slots[level][slot] = NULL;
+            while (timer) {
+                struct alarm_timer *next = timer->next;
+                if (timer->expires <= t) { // due on this very tick, which level 0 runs next
+                    timer->next = alarm_wheel.slots[0][t & (WHEEL_SLOTS - 1)];
+                    alarm_wheel.slots[0][t & (WHEEL_SLOTS - 1)] = timer;
+                } else {
+                    alarm_insert(timer);
+                }
+                timer = next;
+            }
+        }
+        struct alarm_timer **slot = &alarm_wheel.slots[0][t & (WHEEL_SLOTS - 1)];
+        struct alarm_timer *timer = *slot;
+        *slot = NULL;
+        while (timer) {
+            struct alarm_timer *next = timer->next;
+            if (timer->expires > t) { // a later turn of this slot
+                timer->next = *slot;
+                *slot = timer;
+            } else {
+                alarm_ring(timer);
+                rung++;
+                if (timer->repeat > 0) {
+                    timer->expires = next_time_of_day(t, timer->time_of_day);
+                    alarm_insert(timer);
+                } else {
+                    alarm_wheel.count--;
+                    free(timer->file);
+                    free(timer);
+                }
+            }
+            timer = next;
+        }
+    }
+    alarm_wheel.now = now;
+    if (rung > 0)
+        save_alarm_state();
+    alarm_arm();
+    return rung;
+}
+
+void init_alarms() {
+    load_alarm_state();
+    alarm_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (events_fd != -1)
+        event_add(events_fd, alarm_fd, EVENT_ALARM);
+    alarm_expire(); // rings what was due while no shell was running
+}
+
+// Line editor. The terminal stays in raw mode for the whole session and is only
+// switched back for foreground jobs. Every key batch read from the terminal is
+// answered with a single write() holding just the change to the line.
+
+#define HISTORY_SIZE 1000
+
+struct line_editor {
+    char *buf; // the line being edited, NUL terminated
+    size_t len, pos, capacity; // pos is the cursor
+    char *history[HISTORY_SIZE]; // ring, history_count entries ending at history_next - 1
+    int history_next;
+    int history_count;
+    int browsing; // how far back in history Up has gone, 0 = the line being edited
+    char *draft; // the edited line, kept while browsing history
+    bool searching; // in Ctrl+R reverse search
+    char *query;
+    size_t query_len, query_capacity;
+    long match; // history line shown for the query, -1 if none
+    char *original; // the line before the search started
+    int escape_state; // progress through an escape sequence across reads
+    char escape_param[8];
+    size_t escape_len;
+    char *out; // output of the current key batch
+    size_t out_len, out_capacity;
+    const char *prompt; // shown in front of the line
+    size_t prompt_len;
+    bool continuation; // here-document lines: TAB is a character, not completion
+};
+
+struct line_editor editor = {0};
+struct termios backup_termios, raw_termios;
+
+// switches between the editor's raw mode and the user's settings, only when it changes
+void terminal_raw(bool raw) {
+    if (!interactive || raw == terminal_is_raw)
+        return;
+    // TCSANOW tells tcsetattr to change attributes immediately.
+    tcsetattr(STDIN_FILENO, TCSANOW, raw ? &raw_termios : &backup_termios);
+    terminal_is_raw = raw;
+}
+
+void init_terminal() {
+    // tcgetattr gets the parameters of the current terminal
+    tcgetattr(STDIN_FILENO, &backup_termios);
+    raw_termios = backup_termios;
+    // no line buffering, no echo, and ^C/^Z arrive as keys while editing
+    raw_termios.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw_termios.c_cc[VMIN] = 1;
+    raw_termios.c_cc[VTIME] = 0;
+    terminal_raw(true);
+}
+
+void editor_out(const char *s, size_t n) {
+    if (editor.out_len + n > editor.out_capacity) {
+        editor.out_capacity = (editor.out_len + n) * 2;
+        editor.out = realloc(editor.out, editor.out_capacity);
+    }
+    memcpy(editor.out + editor.out_len, s, n);
+    editor.out_len += n;
+}
+
+// moves the cursor n columns, left when negative
+void editor_move(long n) {
+    char seq[32];
+    if (n == 0)
+        return;
+    editor_out(seq, snprintf(seq, sizeof(seq), "\033[%ld%c", n < 0 ? -n : n, n < 0 ? 'D' : 'C'));
+}
+
+void editor_flush() {
+    size_t done = 0;
+    while (done < editor.out_len) {
+        ssize_t n = write(STDOUT_FILENO, editor.out + done, editor.out_len - done);
+        if (n <= 0 && errno != EINTR)
+            break;
+        if (n > 0)
+            done += n;
+    }
+    editor.out_len = 0;
+}
+
+// redraws from the cursor to the end of the line and puts the cursor back
+void editor_redraw_tail(size_t erased) {
+    editor_out(editor.buf + editor.pos, editor.len - editor.pos);
+    editor_out("\033[K", erased ? 3 : 0);
+    editor_move(-(long) (editor.len - editor.pos));
+}
+
+void editor_set_cursor(size_t pos) {
+    editor_move((long) pos - (long) editor.pos);
+    editor.pos = pos;
+}
+
+// replaces the whole line, used for history and completion
+void editor_set_line(const char *line) {
+    size_t len = strlen(line);
+    editor_set_cursor(0);
+    if (len + 1 > editor.capacity) {
+        editor.capacity = len + 256;
+        editor.buf = realloc(editor.buf, editor.capacity);
+    }
+    memcpy(editor.buf, line, len + 1);
+    editor.len = editor.pos = len;
+    editor_out(editor.buf, len);
+    editor_out("\033[K", 3);
+}
+
+void editor_insert(char c) {
+    if (editor.len + 2 > editor.capacity) {
+        editor.capacity = editor.capacity ? editor.capacity * 2 : 256;
+        editor.buf = realloc(editor.buf, editor.capacity);
+    }
+    memmove(editor.buf + editor.pos + 1, editor.buf + editor.pos, editor.len - editor.pos + 1);
+    editor.buf[editor.pos] = c;
+    editor.len++;
+    editor_out(&c, 1);
+    editor.pos++;
+    if (editor.pos < editor.len)
+        editor_redraw_tail(0);
+}
+
+// deletes n characters in front of the cursor
+void editor_delete(size_t n) {
+    if (n == 0)
+        return;
+    memmove(editor.buf + editor.pos, editor.buf + editor.pos + n, editor.len - editor.pos - n + 1);
+    editor.len -= n;
+    editor_redraw_tail(1);
+}
+
+void editor_backspace(size_t n) {
+    if (n > editor.pos)
+        n = editor.pos;
+    editor_set_cursor(editor.pos - n);
+    editor_delete(n);
+}
+
+// start of the word before the cursor / end of the word after it
+size_t editor_word_left() {
+    size_t p = editor.pos;
+    while (p > 0 && is_blank(editor.buf[p - 1]))
+        p--;
+    while (p > 0 && !is_blank(editor.buf[p - 1]))
+        p--;
+    return p;
+}
+
+size_t editor_word_right() {
+    size_t p = editor.pos;
+    while (p < editor.len && is_blank(editor.buf[p]))
+        p++;
+    while (p < editor.len && !is_blank(editor.buf[p]))
+        p++;
+    return p;
+}
+
+// Persistent history. Lines are appended to ~/.shellgibi_history under flock(),
+// so several shells can share it. Two index files sit next to it:
+//   .idx  a header and the byte offset of every line, 8 bytes per line
+//   .tri  a 4096-bit trigram signature for every block of 256 lines
+// All three are mmap()ed read-only for Ctrl+R, which checks each block's
+// signature before it scans the block's lines with memmem().
+
+#define HISTORY_MAGIC 0x3178646968677300ULL // "\0sghidx1"
+#define HISTORY_BLOCK_LINES 256
+#define HISTORY_SIGNATURE_BYTES 512
+
+struct history_index_header {
+    uint64_t magic;
+    uint64_t lines; // lines indexed
+    uint64_t bytes; // bytes of the history file they cover
+    uint64_t reserved;
+};
+
+struct history_file {
+    int fd, index_fd, trigram_fd;
+    const char *map; // the history text
+    size_t map_size;
+    const char *index_map; // header followed by the offsets
+    size_t index_map_size;
+    const unsigned char *signatures;
+    size_t signatures_map_size;
+    uint64_t lines, bytes; // what the maps cover
+};
+
+struct history_file history_file = {.fd = -1, .index_fd = -1, .trigram_fd = -1};
+
+unsigned int trigram_bit(const char *p) {
+    uint32_t t = (unsigned char) p[0] << 16 | (unsigned char) p[1] << 8 | (unsigned char) p[2];
+    return (t * 2654435761u) >> 20; // 12 bits
+}
+
+// counts an indexed line, writing out the signature of the block it completes
+void history_count_line(struct history_index_header *header, unsigned char *signature, uint64_t *block) {
+    header->lines++;
+    if (header->lines % HISTORY_BLOCK_LINES == 0) { // block complete, start the next one
+        pwrite(history_file.trigram_fd, signature, HISTORY_SIGNATURE_BYTES, *block * HISTORY_SIGNATURE_BYTES);
+        memset(signature, 0, HISTORY_SIGNATURE_BYTES);
+        (*block)++;
+    }
+}
+
+/**
+ * Bring the index files up to date with the history file. Called with the lock
+ * held: at startup, and after every append, which may also pick up lines that
+ * another shell wrote without indexing them (it crashed or was killed).
+ */
+void history_index_update() {
+    struct history_index_header header;
+    struct stat st;
+    fstat(history_file.fd, &st);
+    if (pread(history_file.index_fd, &header, sizeof(header), 0) != sizeof(header)
+        || header.magic != HISTORY_MAGIC || header.bytes > (uint64_t) st.st_size) {
+        // missing or does not match the history file: rebuild from scratch
+        header.magic = HISTORY_MAGIC;
+        header.lines = header.bytes = header.reserved = 0;
+        ftruncate(history_file.index_fd, 0);
+        ftruncate(history_file.trigram_fd, 0);
+    }
+    if (header.bytes == (uint64_t) st.st_size)
+        return;
+
+    size_t chunk_size = 1 << 20;
+    if ((uint64_t) st.st_size - header.bytes < chunk_size) // usually just the line we appended
+        chunk_size = st.st_size - header.bytes;
+    char *chunk = malloc(chunk_size);
+    uint64_t *offsets = malloc(sizeof(uint64_t) * chunk_size); // at most one line per byte
+    unsigned char signature[HISTORY_SIGNATURE_BYTES];
+    uint64_t block = header.lines / HISTORY_BLOCK_LINES;
+    if (pread(history_file.trigram_fd, signature, sizeof(signature), block * sizeof(signature)) != sizeof(signature))
+        memset(signature, 0, sizeof(signature));
+
+    while (header.bytes < (uint64_t) st.st_size) {
+        ssize_t n = pread(history_file.fd, chunk, chunk_size, header.bytes);
+        if (n <= 0)
+            break;
+        // only whole lines are indexed, a line still being written is left for later
+        char *last_newline = memrchr(chunk, '\n', n);
+        if (last_newline == NULL) {
+            // a line longer than the chunk: find where it ends and, instead of
+            // reading its trigrams, let its block match every search
+            uint64_t end = header.bytes + n;
+            char *newline = NULL;
+            while (newline == NULL && (n = pread(history_file.fd, chunk, chunk_size, end)) > 0) {
+                newline = memchr(chunk, '\n', n);
+                end += newline ? (uint64_t) (newline - chunk) : (uint64_t) n;
+            }
+            if (newline == NULL)
+                break;
+            pwrite(history_file.index_fd, &header.bytes, sizeof(uint64_t),
+                   sizeof(header) + header.lines * sizeof(uint64_t));
+            memset(signature, 0xff, sizeof(signature));
+            history_count_line(&header, signature, &block);
+            header.bytes = end + 1;
+            continue;
+        }
+        int count = 0;
+        for (char *line = chunk; line <= last_newline;) {
+            char *end = memchr(line, '\n', last_newline - line + 1);
+            offsets[count++] = header.bytes + (line - chunk);
+            for (char *p = line; p + 3 <= end; ++p) {
+                unsigned int bit = trigram_bit(p);
+                signature[bit >> 3] |= 1 << (bit & 7);
+            }
+            history_count_line(&header, signature, &block);
+            line = end + 1;
+        }
+        pwrite(history_file.index_fd, offsets, sizeof(uint64_t) * count,
+               sizeof(header) + (header.lines - count) * sizeof(uint64_t));
+        header.bytes += last_newline - chunk + 1;
+    }
+    pwrite(history_file.trigram_fd, signature, sizeof(signature), block * sizeof(signature));
+    pwrite(history_file.index_fd, &header, sizeof(header), 0);
+    free(offsets);
+    free(chunk);
+}
+
+void history_unmap() {
+    if (history_file.map)
+        munmap((void *) history_file.map, history_file.map_size);
+    if (history_file.index_map)
+        munmap((void *) history_file.index_map, history_file.index_map_size);
+    if (history_file.signatures)
+        munmap((void *) history_file.signatures, history_file.signatures_map_size);
+    history_file.map = history_file.index_map = NULL;
+    history_file.signatures = NULL;
+    history_file.lines = history_file.bytes = 0;
+}
+
+// maps the files again if they grew, nothing is read into the heap
+void history_remap() {
+    struct history_index_header header;
+    if (pread(history_file.index_fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != HISTORY_MAGIC)
+        return;
+    if (header.lines == history_file.lines && history_file.map != NULL)
+        return;
+    history_unmap();
+    if (header.lines == 0)
+        return;
+    history_file.map_size = header.bytes;
+    history_file.index_map_size = sizeof(header) + header.lines * sizeof(uint64_t);
+    history_file.signatures_map_size = ((header.lines + HISTORY_BLOCK_LINES - 1) / HISTORY_BLOCK_LINES)
+                                       * HISTORY_SIGNATURE_BYTES;
+    void *map = mmap(NULL, history_file.map_size, PROT_READ, MAP_SHARED, history_file.fd, 0);
+    void *index_map = mmap(NULL, history_file.index_map_size, PROT_READ, MAP_SHARED, history_file.index_fd, 0);
+    void *signatures = mmap(NULL, history_file.signatures_map_size, PROT_READ, MAP_SHARED,
+                            history_file.trigram_fd, 0);
+    history_file.map = map == MAP_FAILED ? NULL : map;
+    history_file.index_map = index_map == MAP_FAILED ? NULL : index_map;
+    history_file.signatures = signatures == MAP_FAILED ? NULL : signatures;
+    if (history_file.map && history_file.index_map && history_file.signatures) {
+        history_file.lines = header.lines;
+        history_file.bytes = header.bytes;
+    } else {
+        history_unmap();
+    }
+}
+
+// line i of the history file, not NUL terminated
+const char *history_file_line(uint64_t i, size_t *len) {
+    const uint64_t *offsets = (const uint64_t *) (history_file.index_map + sizeof(struct history_index_header));
+    uint64_t end = i + 1 < history_file.lines ? offsets[i + 1] : history_file.bytes;
+    *len = end - offsets[i] - 1; // without the newline
+    return history_file.map + offsets[i];
+}
+
+int open_history_file(const char *home, const char *suffix) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/.shellgibi_history%s", home, suffix);
+    return open(path, O_RDWR | O_CREAT | O_CLOEXEC | (suffix[0] ? 0 : O_APPEND), 0600);
+}
+
+void history_remember(const char *line);
+
+// opens the history files and loads the most recent lines into the editor's ring
+void init_history() {
+    const char *home = getenv("HOME");
+    if (home == NULL)
+        return;
+    history_file.fd = open_history_file(home, "");
+    history_file.index_fd = open_history_file(home, ".idx");
+    history_file.trigram_fd = open_history_file(home, ".tri");
+    if (history_file.fd == -1 || history_file.index_fd == -1 || history_file.trigram_fd == -1) {
+        close(history_file.fd);
+        close(history_file.index_fd);
+        close(history_file.trigram_fd);
+        history_file.fd = history_file.index_fd = history_file.trigram_fd = -1;
+        return;
+    }
+    flock(history_file.fd, LOCK_EX);
+    history_index_update();
+    flock(history_file.fd, LOCK_UN);
+
+    history_remap();
+    uint64_t first = history_file.lines > HISTORY_SIZE ? history_file.lines - HISTORY_SIZE : 0;
+    for (uint64_t i = first; i < history_file.lines; ++i) {
+        size_t len;
+        const char *text = history_file_line(i, &len);
+        char *line = strndup(text, len);
+        history_remember(line);
+        free(line);
+    }
+}
+
+// appends a line for every shell sharing the file
+void history_append(const char *line) {
+    if (history_file.fd == -1)
+        return;
+    size_t len = strlen(line);
+    char *record = malloc(len + 1);
+    memcpy(record, line, len);
+    record[len] = '\n';
+    flock(history_file.fd, LOCK_EX);
+    write(history_file.fd, record, len + 1); // O_APPEND, one write per line
+    history_index_update();
+    flock(history_file.fd, LOCK_UN);
+    free(record);
+}
+
+void history_remember(const char *line) {
+    if (line[0] == 0)
+        return;
+    int last = (editor.history_next + HISTORY_SIZE - 1) % HISTORY_SIZE;
+    if (editor.history_count > 0 && strcmp(editor.history[last], line) == 0)
+        return;
+    free(editor.history[editor.history_next]);
+    editor.history[editor.history_next] = strdup(line);
+    editor.history_next = (editor.history_next + 1) % HISTORY_SIZE;
+    if (editor.history_count < HISTORY_SIZE)
+        editor.history_count++;
+}
+
+void history_add(const char *line) {
+    if (line[0] == 0)
+        return;
+    history_remember(line);
+    history_append(line);
+}
+
+// steps through history, direction 1 is older (Up), -1 newer (Down)
+void history_browse(int direction) {
+    int target = editor.browsing + direction;
+    if (target < 0 || target > editor.history_count)
+        return;
+    if (editor.browsing == 0) {
+        free(editor.draft);
+        editor.draft = strdup(editor.buf);
+    }
+    editor.browsing = target;
+    if (target == 0)
+        editor_set_line(editor.draft);
+    else
+        editor_set_line(editor.history[(editor.history_next + HISTORY_SIZE - target) % HISTORY_SIZE]);
+}
+
+enum editor_result {
+    EDITOR_CONTINUE,
+    EDITOR_SUBMIT,
+    EDITOR_COMPLETE,
+    EDITOR_CANCEL,
+    EDITOR_EOF,
+};
+
+// number of history lines Ctrl+R can see: the whole file if there is one, the ring otherwise
+long history_total() {
+    history_remap();
+    return history_file.map ? (long) history_file.lines : editor.history_count;
+}
+
+// history line i, 0 is the oldest
+const char *history_get(long i, size_t *len) {
+    if (history_file.map)
+        return history_file_line(i, len);
+    const char *line = editor.history[(editor.history_next + HISTORY_SIZE - editor.history_count + i) % HISTORY_SIZE];
+    *len = strlen(line);
+    return line;
+}
+
+/**
+ * Find the newest line before `before` that contains query. Blocks whose
+ * trigram signature misses one of the query's trigrams are skipped whole.
+ * @return line number or -1
+ */
+long history_search(const char *query, size_t query_len, long before) {
+    bool use_signatures = history_file.map != NULL && query_len >= 3;
+    unsigned int *bits = malloc(sizeof(unsigned int) * (query_len + 1));
+    int bit_count = 0;
+    if (use_signatures)
+        for (size_t i = 0; i + 3 <= query_len; ++i)
+            bits[bit_count++] = trigram_bit(query + i);
+
+    long found = -1;
+    long block = -1;
+    for (long i = before - 1; i >= 0; --i) {
+        if (use_signatures && i / HISTORY_BLOCK_LINES != block) {
+            block = i / HISTORY_BLOCK_LINES;
+            const unsigned char *signature = history_file.signatures + block * HISTORY_SIGNATURE_BYTES;
+            bool candidate = true;
+            for (int b = 0; b < bit_count && candidate; ++b)
+                candidate = signature[bits[b] >> 3] & (1 << (bits[b] & 7));
+            if (!candidate) {
+                i = block * HISTORY_BLOCK_LINES; // the loop's --i moves to the previous block
+                continue;
+            }
+        }
+        size_t len;
+        const char *line = history_get(i, &len);
+        if (memmem(line, len, query, query_len) != NULL) {
+            found = i;
+            break;
+        }
+    }
+    free(bits);
+    return found;
+}
+
+void editor_replace(const char *line, size_t len) {
+    if (len + 1 > editor.capacity) {
+        editor.capacity = len + 256;
+        editor.buf = realloc(editor.buf, editor.capacity);
+    }
+    memcpy(editor.buf, line, len);
+    editor.buf[len] = 0;
+    editor.len = editor.pos = len;
+}
+
+// shows "(reverse-i-search)`query': match" in place of the prompt
+void editor_search_render() {
+    size_t len = 0;
+    const char *line = editor.match >= 0 ? history_get(editor.match, &len) : "";
+    editor_out("\r", 1);
+    if (editor.match < 0 && editor.query_len > 0)
+        editor_out("(failed ", 8);
+    editor_out("(reverse-i-search)`", 19);
+    editor_out(editor.query, editor.query_len);
+    editor_out("': ", 3);
+    editor_out(line, len);
+    editor_out("\033[K", 3);
+}
+
+// draws the prompt and the line again, e.g. after an alarm printed over them
+void editor_redisplay() {
+    if (editor.searching) {
+        editor_search_render();
+        return;
+    }
+    editor_out("\r\033[K", 4);
+    editor_out(editor.prompt, editor.prompt_len);
+    editor_out(editor.buf, editor.len);
+    editor_move(-(long) (editor.len - editor.pos));
+}
+
+// leaves search mode with the matched line (or the original) back behind the prompt
+void editor_search_end(bool accept) {
+    size_t len;
+    if (accept && editor.match >= 0) {
+        const char *line = history_get(editor.match, &len);
+        editor_replace(line, len);
+    } else {
+        editor_replace(editor.original, strlen(editor.original));
+    }
+    editor.searching = false;
+    free(editor.original);
+    editor.original = NULL;
+    editor_redisplay();
+}
+
+enum editor_result editor_key(char c);
+
+enum editor_result editor_search_key(char c) {
+    if (c == 18) { // Ctrl+R again, look further back
+        long match = history_search(editor.query, editor.query_len,
+                                    editor.match >= 0 ? editor.match : history_total());
+        if (match >= 0)
+            editor.match = match;
+    } else if (c == 127 || c == 8) {
+        if (editor.query_len > 0)
+            editor.query_len--;
+        editor.match = editor.query_len ? history_search(editor.query, editor.query_len, history_total()) : -1;
+    } else if (c == 7) { // Ctrl+G gives up
+        editor_search_end(false);
+        return EDITOR_CONTINUE;
+    } else if (c == '\r' || c == '\n') {
+        editor_search_end(true);
+        return EDITOR_SUBMIT;
+    } else if ((unsigned char) c >= 32) {
+        if (editor.query_len + 1 >= editor.query_capacity) {
+            editor.query_capacity = editor.query_capacity ? editor.query_capacity * 2 : 64;
+            editor.query = realloc(editor.query, editor.query_capacity);
+        }
+        editor.query[editor.query_len++] = c;
+        // the current match may still fit the longer query
+        editor.match = history_search(editor.query, editor.query_len,
+                                      editor.match >= 0 ? editor.match + 1 : history_total());
+    } else { // any other key accepts the match and is then handled as usual
+        editor_search_end(true);
+        return editor_key(c);
+    }
+    editor_search_render();
+    return EDITOR_CONTINUE;
+}
+
+// the final byte of an escape sequence: ESC [ <param> <final> or ESC O <final>
+void editor_escape(char final) {
+    bool ctrl = strcmp(editor.escape_param, "1;5") == 0; // Ctrl+arrow
+    switch (final) {
+        case 'A': // up arrow
+            history_browse(1);
+            break;
+        case 'B': // down arrow
+            history_browse(-1);
+            break;
+        case 'C': // right arrow
+            editor_set_cursor(ctrl ? editor_word_right() : editor.pos + (editor.pos < editor.len));
+            break;
+        case 'D': // left arrow
+            editor_set_cursor(ctrl ? editor_word_left() : editor.pos - (editor.pos > 0));
+            break;
+        case 'H': // home
+            editor_set_cursor(0);
+            break;
+        case 'F': // end
+            editor_set_cursor(editor.len);
+            break;
+        case '~':
+            if (strcmp(editor.escape_param, "1") == 0 || strcmp(editor.escape_param, "7") == 0)
+                editor_set_cursor(0);
+            else if (strcmp(editor.escape_param, "4") == 0 || strcmp(editor.escape_param, "8") == 0)
+                editor_set_cursor(editor.len);
+            else if (strcmp(editor.escape_param, "3") == 0 && editor.pos < editor.len) // delete
+                editor_delete(1);
+            break;
+    }
+}
+
+// handles one input byte
+enum editor_result editor_key(char c) {
+    if (editor.searching)
+        return editor_search_key(c);
+    if (editor.escape_state == 1) { // after ESC
+        editor.escape_state = 0;
+        if (c == '[' || c == 'O') {
+            editor.escape_state = 2;
+            editor.escape_len = 0;
+            editor.escape_param[0] = 0;
+        } else if (c == 'b') { // Alt+b, word left
+            editor_set_cursor(editor_word_left());
+        } else if (c == 'f') { // Alt+f, word right
+            editor_set_cursor(editor_word_right());
+        }
+        return EDITOR_CONTINUE;
+    }
+    if (editor.escape_state == 2) {
+        if ((c >= '0' && c <= '9') || c == ';') {
+            if (editor.escape_len < sizeof(editor.escape_param) - 1) {
+                editor.escape_param[editor.escape_len++] = c;
+                editor.escape_param[editor.escape_len] = 0;
+            }
+            return EDITOR_CONTINUE;
+        }
+        editor.escape_state = 0;
+        editor_escape(c);
+        return EDITOR_CONTINUE;
+    }
+
+    switch (c) {
+        case 27: // handle multi-code keys
+            editor.escape_state = 1;
+            break;
+        case '\r':
+        case '\n': // enter key
+            return EDITOR_SUBMIT;
+        case '\t': // handle tab
+            if (editor.continuation) {
+                editor_insert(c);
+                break;
+            }
+            return EDITOR_COMPLETE;
+        case 127: // handle backspace
+        case 8:
+            editor_backspace(1);
+            break;
+        case 1: // Ctrl+A
+            editor_set_cursor(0);
+            break;
+        case 5: // Ctrl+E
+            editor_set_cursor(editor.len);
+            break;
+        case 2: // Ctrl+B
+            editor_set_cursor(editor.pos - (editor.pos > 0));
+            break;
+        case 6: // Ctrl+F
+            editor_set_cursor(editor.pos + (editor.pos < editor.len));
+            break;
+        case 3: // Ctrl+C drops the line
+            return EDITOR_CANCEL;
+        case 18: // Ctrl+R, reverse search through the history file
+            editor.searching = true;
+            if (editor.query == NULL) {
+                editor.query_capacity = 64;
+                editor.query = malloc(editor.query_capacity);
+            }
+            editor.query_len = 0;
+            editor.match = -1;
+            editor.original = strdup(editor.buf);
+            editor_search_render();
+            break;
+        case 4: // Ctrl+D
+            if (editor.len == 0)
+                return EDITOR_EOF;
+            if (editor.pos < editor.len)
+                editor_delete(1);
+            break;
+        case 11: // Ctrl+K
+            editor_delete(editor.len - editor.pos);
+            break;
+        case 21: // Ctrl+U
+            editor_backspace(editor.pos);
+            break;
+        case 23: // Ctrl+W
+            editor_backspace(editor.pos - editor_word_left());
+            break;
+        default:
+            if ((unsigned char) c >= 32)
+                editor_insert(c);
+            break;
+    }
+    return EDITOR_CONTINUE;
+}
+
+// the line of the last TAB, shown again at the next prompt
+char *completion_line = NULL;
+
+// puts the line back after a TAB, completing the last word when there was one match
+void restore_completion_line() {
+    size_t len = strlen(completion_line);
+    size_t word = len;
+    while (word > 0 && !is_blank(completion_line[word - 1]) && strchr("|<>&", completion_line[word - 1]) == NULL)
+        word--;
+    editor_set_line(completion_line);
+    if (possible_commands_count == 1) {
+        const char *slash = strrchr(completion_line + word, '/');
+        size_t keep = slash ? (size_t) (slash - completion_line) + 1 : word;
+        editor_backspace(len - keep);
+        for (const char *p = suggestion_list[0]; *p; ++p)
+            editor_insert(*p);
+    }
+    free(completion_line);
+    completion_line = NULL;
+}
+
+/**
+ * Read one line into editor.buf behind prompt_text, handling jobs, alarms and
+ * signals that arrive meanwhile.
+ * @return EDITOR_SUBMIT, EDITOR_COMPLETE, EDITOR_CANCEL or EDITOR_EOF
+ */
+enum editor_result editor_read_line(const char *prompt_text, size_t prompt_len) {
+    terminal_raw(true);
+    fflush(stdout); // output of the last command must come before the prompt
+    editor.prompt = prompt_text;
+    editor.prompt_len = prompt_len;
+    editor_out(prompt_text, prompt_len);
+
+    editor.len = editor.pos = 0;
+    editor.browsing = 0;
+    editor.escape_state = 0;
+    if (editor.capacity == 0) {
+        editor.capacity = 256;
+        editor.buf = malloc(editor.capacity);
+    }
+    editor.buf[0] = 0;
+    if (completion_line != NULL)
+        restore_completion_line();
+    editor_flush(); // prompt and any restored line in one write
+
+    enum editor_result result = EDITOR_CONTINUE;
+    char keys[256];
+    while (result == EDITOR_CONTINUE) {
+        if (events_fd != -1) {
+            struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {events_fd, POLLIN, 0}};
+            if (poll(fds, 2, -1) == -1)
+                continue;
+            if (fds[1].revents & POLLIN) {
+                bool redraw = run_events(0) > 0;
+                if (child_changed) {
+                    reap_jobs();
+                    if (jobs_need_notice()) {
+                        editor_out("\r\033[K", 4);
+                        editor_flush();
+                        notify_jobs();
+                        redraw = true;
+                    }
+                }
+                if (window_resized) {
+                    window_resized = false;
+                    redraw = true;
+                }
+                if (interrupt_received) {
+                    interrupt_received = false;
+                    result = EDITOR_CANCEL;
+                    break;
+                }
+                if (redraw) {
+                    fflush(stdout);
+                    editor_redisplay();
+                    editor_flush();
+                }
+            }
+            if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+        }
+        ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            result = EDITOR_EOF;
+            break;
+        }
+        for (ssize_t i = 0; i < n && result == EDITOR_CONTINUE; ++i)
+            result = editor_key(keys[i]);
+        editor_flush();
+    }
+
+    if (result == EDITOR_EOF)
+        return result;
+    editor_set_cursor(editor.len);
+    editor_out(result == EDITOR_CANCEL ? "^C\n" : "\n", result == EDITOR_CANCEL ? 3 : 1);
+    editor_flush();
+    return result;
+}
+
+// one here-document line from the terminal behind "> ", NULL on ^D or, setting *cancelled, ^C
+char *editor_continuation_line(bool *cancelled) {
+    editor.continuation = true;
+    enum editor_result result = editor_read_line("> ", 2);
+    editor.continuation = false;
+    *cancelled = result == EDITOR_CANCEL;
+    return result == EDITOR_SUBMIT ? editor.buf : NULL;
+}
+
+struct line_reader;
+char *read_line(struct line_reader *reader);
+
+// the script or -c text being run, here-documents take their lines from it too
+struct line_reader *here_reader = NULL;
+
+/**
+ * Read the bodies of a line's here-documents from the lines after it, in the
+ * order they were written, each up to a line that is just its delimiter.
+ * @return false if the user cancelled one with ^C
+ */
+bool read_here_documents(struct command_t *command) {
+    for (struct command_t *c = command; c; c = c->next) {
+        for (struct redirect *r = c->redirects; r; r = r->next) {
+            if (r->type != REDIRECT_HERE || !r->unread)
+                continue;
+            size_t used = 0, capacity = 256;
+            char *body = malloc(capacity), *line;
+            bool cancelled = false;
+            while ((line = here_reader ? read_line(here_reader)
+                                       : interactive ? editor_continuation_line(&cancelled) : NULL) != NULL) {
+                if (r->strip_tabs)
+                    line += strspn(line, "\t");
+                if (strcmp(line, r->target) == 0)
+                    break;
+                size_t len = strlen(line);
+                while (used + len + 1 > capacity) {
+                    capacity *= 2;
+                    body = realloc(body, capacity);
+                }
+                memcpy(body + used, line, len);
+                body[used + len] = '\n';
+                used += len + 1;
+            }
+            r->target = arena_strndup(&parse_arena, body, used);
+            r->len = used;
+            r->unread = false;
+            free(body);
+            if (cancelled)
+                return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Prompt a command from the user
+ * @param  command filled in by parse_command() from the line
+ * @return         SUCCESS, or EXIT on Ctrl+D at an empty line
+ */
+int prompt(struct command_t *command) {
+    size_t prompt_len;
+    const char *prompt_text = render_prompt(&prompt_len);
+    enum editor_result result = editor_read_line(prompt_text, prompt_len);
+    if (result == EDITOR_EOF)
+        return EXIT;
+    if (result == EDITOR_CANCEL)
+        editor.buf[editor.len = 0] = 0; // run an empty command
+
+    if (result == EDITOR_COMPLETE) {
+        completion_line = strdup(editor.buf);
+        editor_insert('?'); // autocomplete
+        editor.out_len = 0;
+    } else if (result == EDITOR_SUBMIT) {
+        history_add(editor.buf);
+    }
+
+    // the lexer writes into the line, so parse a copy
+    parse_command(arena_strndup(&parse_arena, editor.buf, editor.len), command);
+    command->auto_complete = result == EDITOR_COMPLETE; // only TAB completes, a typed '?' is a glob
+    if (!command->auto_complete && !read_here_documents(command)) {
+        memset(command, 0, sizeof(struct command_t)); // cancelled, run nothing
+        command->name = "";
+    }
+
+    // print_command(command); // DEBUG: uncomment for debugging
+    return SUCCESS;
+}
+
+// buffered reader for batch mode, hands out one line at a time from large read() chunks
+struct line_reader {
+    int fd;
+    char *buf;
+    size_t start, end, capacity;
+    bool eof;
+};
+
+#define BATCH_CHUNK (1 << 20)
+
+/**
+ * Return the next line without its newline, NUL terminated inside the reader's
+ * buffer and valid until the next call. Lines of any length are supported.
+ * @return the line or NULL at end of input
+ */
+char *read_line(struct line_reader *reader) {
+    while (1) {
+        char *newline = memchr(reader->buf + reader->start, '\n', reader->end - reader->start);
+        if (newline != NULL || (reader->eof && reader->start < reader->end)) {
+            char *line = reader->buf + reader->start;
+            if (newline == NULL) // last line without a newline, there is always room for the NUL
+                newline = reader->buf + reader->end;
+            *newline = 0;
+            reader->start = newline - reader->buf + 1;
+            if (reader->start > reader->end)
+                reader->start = reader->end;
+            return line;
+        }
+        if (reader->eof)
+            return NULL;
+
+        // move the partial line to the front and grow if a single line fills the buffer
+        memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+        if (reader->capacity - reader->end < BATCH_CHUNK / 2) {
+            reader->capacity *= 2;
+            reader->buf = realloc(reader->buf, reader->capacity);
+        }
+        ssize_t n = read(reader->fd, reader->buf + reader->end, reader->capacity - reader->end - 1);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            reader->eof = true;
+        else
+            reader->end += n;
+    }
+}
+
+int run_line(char *line);
+
+// runs every line of the reader, which also feeds their here-documents
+void run_lines(struct line_reader *reader) {
+    char *line;
+    here_reader = reader;
+    while ((line = read_line(reader)) != NULL)
+        if (run_line(line) == EXIT)
+            break;
+    here_reader = NULL;
+}
+
+// parses and runs one line outside of the interactive prompt
+int run_line(char *line) {
+    while (*line == ' ' || *line == '\t')
+        line++;
+    if (*line == 0 || *line == '#') // blank lines and comments, including a #! line
+        return SUCCESS;
+
+    struct command_t *command = new_command();
+    // reading a here-document moves the reader's buffer, so such a line is parsed from a copy
+    parse_command(strstr(line, "<<") ? arena_strndup(&parse_arena, line, strlen(line)) : line, command);
+    read_here_documents(command);
+    int code = process_command(command);
+    arena_reset(&parse_arena);
+    notify_jobs();
+    return code;
+}
+
+/**
+ * Batch mode: run every line from fd with no terminal setup and no prompt.
+ * Input is read ahead in large chunks, so commands that want the shell's
+ * stdin should get an explicit "<" redirection.
+ * @return exit status of the last command
+ */
+int run_batch(int fd) {
+    struct line_reader reader = {fd, malloc(BATCH_CHUNK), 0, 0, BATCH_CHUNK, false};
+    run_lines(&reader);
+    free(reader.buf);
+    return last_status;
+}
+
+#ifndef SHELLGIBI_NO_MAIN // the benchmarks include this file and bring their own main()
+int main(int argc, char *argv[]) {
+    init_jobs();
+
+    // shellgibi -c "cmd", shellgibi script.sh, or commands piped into stdin
+    if (argc == 2 && strcmp(argv[1], "-c") == 0) {
+        fprintf(stderr, "%s: -c: option requires an argument\nusage: %s [-c command | script]\n", sysname, sysname);
+        return 2;
+    }
+    if (argc > 2 && strcmp(argv[1], "-c") == 0) {
+        // the text is already all there, a reader at end of input just splits it into lines
+        size_t len = strlen(argv[2]);
+        struct line_reader reader = {-1, strdup(argv[2]), 0, len, len + 1, true};
+        run_lines(&reader);
+        free(reader.buf);
+        return last_status;
+    }
+    if (argc > 1) {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "%s: %s: %s\n", sysname, argv[1], strerror(errno));
+            return 127;
+        }
+        return run_batch(fd);
+    }
+    if (!isatty(STDIN_FILENO))
+        return run_batch(STDIN_FILENO);
+
+    interactive = true;
+    init_terminal();
+    init_history();
+    init_alarms();
+    while (1) {
+        struct command_t *command = new_command();
+
+        notify_jobs(); // report background jobs that finished since the last prompt
+
+        int code;
+        code = prompt(command);
+        if (code == EXIT) break;
+
+        code = process_command(command);
+        if (code == EXIT) break;
+
+        arena_reset(&parse_arena); // frees the command
+    }
+
+    printf("\n");
+    terminal_raw(false); // restore the old settings
+    return 0;
+}
+#endif
+
+// execute using execv()
+int execute(struct command_t *command) {
+    int res = -1;
+
+    if (strchr(command->name, '/') != NULL) {
+        // paths such as ./prog or /usr/bin/env are executed as they are
+        res = execv(command->name, command->argv);
+    } else if (command->path != NULL) {
+        // resolved from $PATH by the command hash before forking
+        res = execv(command->path, command->argv);
+    }
+
+    if (res == -1) {
+        printf("No such command found.\n");
+    }
+    return res;
+}
+
+int write_all(int fd, const char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+#define HERE_PIPE_MAX 65536 // default pipe capacity, larger here data goes into a memfd
+
+/**
+ * A descriptor to read here data from. Data that fits in a pipe's buffer is
+ * written into a pipe, which never blocks then; anything larger goes into a
+ * memfd, so it never touches the disk either way. Only plain system calls, so a
+ * vfork()ed child may call this too.
+ * @return the read end, or -1
+ */
+int here_data_fd(const char *data, size_t len) {
+    int fds[2];
+    if (len <= HERE_PIPE_MAX && pipe2(fds, O_CLOEXEC) == 0) {
+        if (fcntl(fds[1], F_GETPIPE_SZ) >= (long) len) {
+            write_all(fds[1], data, len);
+            close(fds[1]);
+            return fds[0];
+        }
+        close(fds[0]);
+        close(fds[1]);
+    }
+    int fd = memfd_create("shellgibi-here", MFD_CLOEXEC);
+    if (fd == -1 || write_all(fd, data, len) == -1 || lseek(fd, 0, SEEK_SET) == -1) {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// descriptors replaced by a builtin's redirections, put back by restore_redirects()
+struct saved_fds {
+    int *fd;
+    int *copy; // -1 when fd was not open
+    int count, capacity;
+};
+
+// copies fd before its first replacement, moving a copy that is in the way
+void save_fd(struct saved_fds *saved, int fd) {
+    int copy = -2;
+    for (int i = 0; i < saved->count; ++i) {
+        if (saved->fd[i] == fd)
+            return;
+        if (saved->copy[i] == fd) { // the shell never had fd open, one of our copies did
+            saved->copy[i] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+            close(fd);
+            copy = -1;
+        }
+    }
+    if (saved->count == saved->capacity) {
+        saved->capacity = saved->capacity ? saved->capacity * 2 : 8;
+        saved->fd = realloc(saved->fd, sizeof(int) * saved->capacity);
+        saved->copy = realloc(saved->copy, sizeof(int) * saved->capacity);
+    }
+    saved->fd[saved->count] = fd;
+    saved->copy[saved->count++] = copy == -2 ? fcntl(fd, F_DUPFD_CLOEXEC, 10) : copy;
+}
+
+/**
+ * Apply a command's redirections to this process in the order they were
+ * written. Only system calls and dprintf(), so a vfork()ed child can use it.
+ * @param  saved NULL in a child; for a builtin in the shell, every descriptor
+ *               is copied here before it is first replaced, in arrays that
+ *               grow as needed and are freed by restore_redirects()
+ * @return       0, or -1 after the failing one was reported
+ */
+int apply_redirects(struct command_t *command, struct saved_fds *saved) {
+    for (struct redirect *r = command->redirects; r; r = r->next) {
+        int fd = -1;
+        if (r->type == REDIRECT_TEE) // tee_command() opens it itself
+            continue;
+        if (saved != NULL) // before opening, which could take r->fd itself
+            save_fd(saved, r->fd);
+        if (r->type == REDIRECT_DUP)
+            fd = r->from_fd;
+        else if (r->type == REDIRECT_HERE)
+            fd = here_data_fd(r->target, r->len);
+        else
+            fd = open(r->target, O_CLOEXEC | (r->type == REDIRECT_IN ? O_RDONLY : r->type == REDIRECT_OUT
+                                               ? O_WRONLY | O_CREAT | O_TRUNC : O_WRONLY | O_CREAT | O_APPEND), 0644);
+        if (fd == -1 && r->type != REDIRECT_DUP) {
+            const char *error = strerror(errno);
+            dprintf(STDERR_FILENO, "-%s: %s: %s\n", sysname, r->type == REDIRECT_HERE ? "here-document" : r->target,
+                    error);
+            return -1;
+        }
+        if (fd == -1) {
+            close(r->fd);
+        } else if (fd != r->fd) {
+            if (dup2(fd, r->fd) == -1) {
+                const char *error = strerror(errno);
+                dprintf(STDERR_FILENO, "-%s: %d: %s\n", sysname, fd, error);
+                return -1;
+            }
+            if (r->type != REDIRECT_DUP)
+                close(fd);
+        } else {
+            fcntl(fd, F_SETFD, 0); // opened right onto r->fd, it must survive exec
+        }
+    }
+    return 0;
+}
+
+// undoes apply_redirects() for a builtin that ran in the shell
+void restore_redirects(struct saved_fds *saved) {
+    for (int i = saved->count - 1; i >= 0; --i) {
+        if (saved->copy[i] == -1) {
+            close(saved->fd[i]);
+        } else {
+            dup2(saved->copy[i], saved->fd[i]);
+            close(saved->copy[i]);
+        }
+    }
+    free(saved->fd);
+    free(saved->copy);
+    memset(saved, 0, sizeof(*saved));
+}
+
+// moves len bytes from the pipe in_fd to out_fd, inside the kernel when out_fd allows it
+int splice_all(int in_fd, int out_fd, size_t len) {
+    while (len > 0) {
+        ssize_t n = splice(in_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EINVAL) { // e.g. a terminal, copy through a buffer instead
+            char buf[65536];
+            n = read(in_fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+            if (n > 0 && write(out_fd, buf, n) != n)
+                return -1;
+        }
+        if (n <= 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// copies the first size bytes of the file in_fd to out_fd, inside the kernel when it can
+int send_file_all(int out_fd, int in_fd, off_t size) {
+    off_t offset = 0;
+    while (offset < size && sendfile(out_fd, in_fd, &offset, size - offset) > 0);
+    char buf[65536];
+    ssize_t n;
+    // sendfile() refuses some outputs, e.g. files opened with O_APPEND
+    while (offset < size && (n = pread(in_fd, buf, sizeof(buf), offset)) > 0 && write(out_fd, buf, n) == n)
+        offset += n;
+    return offset == size ? 0 : -1;
+}
+
+// runs the command with its stdout going through a pipe that is duplicated
+// with tee() onto stdout and spliced into file_fd, without copying to userspace
+int tee_command(struct command_t *command, int file_fd) {
+    int out[2], copy[2];
+    struct stat st;
+    // tee() needs a pipe on both sides; add one in front of stdout if it is not a pipe
+    bool stdout_is_pipe = fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+    if (pipe(out) == -1 || (!stdout_is_pipe && pipe(copy) == -1)) {
+        fprintf(stderr, "-%s: pipe: %s\n", sysname, strerror(errno));
+        exit(1);
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(out[1], STDOUT_FILENO);
+        close(out[0]);
+        close(out[1]);
+        close(file_fd);
+        if (!stdout_is_pipe) {
+            close(copy[0]);
+            close(copy[1]);
+        }
+        exit(run_program(command));
+    }
+    close(out[1]);
+
+    int tee_fd = stdout_is_pipe ? STDOUT_FILENO : copy[1];
+    while (1) {
+        ssize_t n = tee(out[0], tee_fd, INT_MAX, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        if (splice_all(out[0], file_fd, n) == -1)
+            break;
+        if (!stdout_is_pipe && splice_all(copy[0], STDOUT_FILENO, n) == -1)
+            break;
+    }
+    close(out[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+// redirection command for "<", ">" and ">>", runs in the child:
+// the files are opened and dup2()'d over stdin/stdout, then the command is exec'd
+int redirection_command(struct command_t *command) {
+    if (apply_redirects(command, NULL) == -1)
+        exit(1);
+
+    if (command->tee_output) {
+        // the file gets its own descriptor, stdout stays where it is
+        struct redirect *tee = command->redirects;
+        while (tee->type != REDIRECT_TEE)
+            tee = tee->next;
+        int file_fd = open(tee->target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file_fd == -1) {
+            fprintf(stderr, "-%s: %s: %s\n", sysname, tee->target, strerror(errno));
+            exit(1);
+        }
+        exit(tee_command(command, file_fd));
+    }
+
+    exit(run_program(command));
+}
+
+int process_command(struct command_t *command) {
+    if (command->auto_complete) {
+        clear_suggestions();
+        if(command->next!=NULL) {
+            command = command->next;
+            command->auto_complete=true;
+            process_command(command);
+        } else {
+            // the word being completed is the one that ends in '?': a redirect
+            // target, the last argument or the command name itself
+            for (int i = 0; i < command->arg_count + 1; ++i)
+                restore_literal(command->argv[i]);
+            for (struct redirect *r = command->redirects; r; r = r->next)
+                if (r->type <= REDIRECT_TEE)
+                    restore_literal(r->target);
+            char *head = command->name;
+            if (command->arg_count > 0)
+                head = command->args[command->arg_count - 1];
+            for (struct redirect *r = command->redirects; r; r = r->next)
+                if (r->type <= REDIRECT_TEE && r->target[0] != 0 && r->target[strlen(r->target) - 1] == '?')
+                    head = r->target;
+            if (head[0] == 0 || head[strlen(head) - 1] != '?')
+                head = command->name;
+            if (head == command->name && strchr(head, '/') == NULL)
+                populate_suggestion_list(head);
+            else
+                get_possible_file_list(head);
+            printf("\n");
+            if (possible_commands_count==1) {
+                printf("%s\n", suggestion_list[0]);
+            } else {
+                for (int i = 0; i < possible_commands_count; ++i) {
+                    printf("%s\t", suggestion_list[i]);
+                    if (i % 5 == 4) {
+                        printf("\n");
+                    }
+                }
+                printf("\n");
+            }
+        }
+        return 0;
+    }
+
+    expand_command(command);
+    if (strcmp(command->name, "") == 0) return SUCCESS;
+
+    // a builtin on its own runs in the shell process, no fork and no exec, unless
+    // it has launch settings: those are for a child, never for the shell itself
+    const struct builtin *builtin = find_builtin(command->name);
+    if (builtin != NULL && (builtin->flags & BUILTIN_PREFIX))
+        return builtin->run(command);
+    if (builtin != NULL && command->next == NULL && !command->background
+        && !(builtin->flags & (BUILTIN_EXTERNAL | BUILTIN_FILTER)) && !command->tee_output && command->launch == NULL) {
+        last_status = run_builtin(command, builtin);
+        if (builtin->flags & BUILTIN_EXIT)
+            return EXIT;
+        return SUCCESS;
+    }
+
+    // wiki and volume become the program they wrap, for every stage of a pipeline
+    for (struct command_t *c = command; c; c = c->next) {
+        builtin = find_builtin(c->name);
+        if (builtin != NULL && (builtin->flags & BUILTIN_EXTERNAL) && builtin->run(c) != SUCCESS) {
+            last_status = UNKNOWN;
+            return SUCCESS;
+        }
+    }
+
+    // resolve in the parent so the command hash outlives the child
+    resolve_command_paths(command);
+
+    last_status = execute_pipeline(command);
+    return SUCCESS;
+}
+
+// changes the directory, to $HOME without an argument
+int cd_command(struct command_t *command) {
+    const char *dir = command->arg_count > 0 ? command->args[0] : getenv("HOME");
+    if (dir == NULL || chdir(dir) == -1) {
+        printf("-%s: %s: %s\n", sysname, command->name, dir ? strerror(errno) : "HOME not set");
+        return UNKNOWN;
+    }
+    prompt_invalidate_cwd();
+    return SUCCESS;
+}
+
+// "exit [status]", the status is returned by a script or -c
+int exit_command(struct command_t *command) {
+    return command->arg_count > 0 ? atoi(command->args[0]) : last_status;
+}
+
+// strips the first word of a command, for prefixes like time
+void shift_command(struct command_t *command) {
+    command->argv++;
+    command->args++;
+    command->arg_count--;
+    command->name = command->argv[0];
+}
+
+void print_seconds(const char *label, long sec, long usec) {
+    fprintf(stderr, "%s\t%ldm%ld.%03lds\n", label, sec / 60, sec % 60, usec / 1000);
+}
+
+/**
+ * time command...
+ * Runs the rest of the line and reports on stderr its wall clock time, and
+ * the user and sys time, largest resident set and context switches of every
+ * child reaped in the foreground meanwhile, as wait4() returned them. Time the
+ * shell itself spent, e.g. in a builtin, is added to user and sys.
+ * @return what process_command() returned for the rest of the line
+ */
+int time_command(struct command_t *command) {
+    struct rusage self_before, self_after;
+    if (command->arg_count == 0) {
+        printf("-%s: time: usage: time command [args]\n", sysname);
+        last_status = UNKNOWN;
+        return SUCCESS;
+    }
+    shift_command(command);
+    memset(&child_usage, 0, sizeof(child_usage));
+    getrusage(RUSAGE_SELF, &self_before);
+    uint64_t start = now_ns();
+
+    int code = process_command(command);
+
+    uint64_t wall = (now_ns() - start) / 1000;
+    getrusage(RUSAGE_SELF, &self_after);
+    long user = (child_usage.ru_utime.tv_sec + self_after.ru_utime.tv_sec - self_before.ru_utime.tv_sec) * 1000000
+                + child_usage.ru_utime.tv_usec + self_after.ru_utime.tv_usec - self_before.ru_utime.tv_usec;
+    long sys = (child_usage.ru_stime.tv_sec + self_after.ru_stime.tv_sec - self_before.ru_stime.tv_sec) * 1000000
+               + child_usage.ru_stime.tv_usec + self_after.ru_stime.tv_usec - self_before.ru_stime.tv_usec;
+    // without children the largest resident set is our own
+    long maxrss = child_usage.ru_maxrss ? child_usage.ru_maxrss : self_after.ru_maxrss;
+
+    fflush(stdout);
+    fprintf(stderr, "\n");
+    print_seconds("real", wall / 1000000, wall % 1000000);
+    print_seconds("user", user / 1000000, user % 1000000);
+    print_seconds("sys", sys / 1000000, sys % 1000000);
+    fprintf(stderr, "maxrss\t%ldK\n", maxrss);
+    fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n",
+            child_usage.ru_nvcsw + self_after.ru_nvcsw - self_before.ru_nvcsw,
+            child_usage.ru_nivcsw + self_after.ru_nivcsw - self_before.ru_nivcsw);
+    return code;
+}
+
+// The cache builtin memoizes deterministic commands. A key is a digest of the
+// argv, the working directory, the chosen environment variables and the size
+// and mtime of every input file. keys/<key> holds the exit status and the
+// digest of the captured stdout, which lives in objects/<digest>, so the same
+// output is stored once however many commands produced it. A key's mtime is
+// its last use; the oldest keys go first when the store outgrows cachesize.
+
+// 128 bits from two 64 bit lanes, meant for telling cache entries apart and
+// not for security
+struct digest {
+    uint64_t a, b, len;
+};
+
+uint64_t digest_mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    return x ^ (x >> 33);
+}
+
+void digest_init(struct digest *d) {
+    d->a = 0x9e3779b97f4a7c15ULL;
+    d->b = 0x632be59bd9b4e019ULL;
+    d->len = 0;
+}
+
+void digest_update(struct digest *d, const void *data, size_t len) {
+    const unsigned char *p = data;
+    d->len += len;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        d->a = ((d->a ^ w) << 31 | (d->a ^ w) >> 33) * 0x87c37b91114253d5ULL;
+        d->b = ((d->b + w) << 27 | (d->b + w) >> 37) * 0x4cf5ad432745937fULL ^ d->a;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, p, len);
+    d->a = (d->a ^ tail ^ len) * 0x87c37b91114253d5ULL;
+    d->b = (d->b + tail) * 0x4cf5ad432745937fULL;
+}
+
+// strings go in with their NUL so "ab" "c" and "a" "bc" differ
+void digest_string(struct digest *d, const char *s) {
+    digest_update(d, s ? s : "", s ? strlen(s) + 1 : 1);
+}
+
+void digest_hex(struct digest *d, char hex[33]) {
+    uint64_t a = digest_mix(d->a ^ d->len), b = digest_mix(d->b ^ a);
+    snprintf(hex, 33, "%016" PRIx64 "%016" PRIx64, a, b);
+}
+
+// the store under $XDG_CACHE_HOME or ~/.cache, created on first use
+const char *cache_dir() {
+    static char dir[PATH_MAX];
+    if (dir[0])
+        return dir;
+    const char *base = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    if (base && base[0])
+        snprintf(dir, sizeof(dir), "%s/%s", base, sysname);
+    else if (home)
+        snprintf(dir, sizeof(dir), "%s/.cache/%s", home, sysname);
+    else
+        return NULL;
+    char path[PATH_MAX + 16];
+    for (char *p = dir + 1; *p; ++p) { // mkdir -p
+        if (*p == '/') {
+            *p = 0;
+            mkdir(dir, 0700);
+            *p = '/';
+        }
+    }
+    mkdir(dir, 0700);
+    snprintf(path, sizeof(path), "%s/keys", dir);
+    mkdir(path, 0700);
+    snprintf(path, sizeof(path), "%s/objects", dir);
+    mkdir(path, 0700);
+    return dir;
+}
+
+// hits, misses and bytes replayed, kept in the store across shells
+struct cache_counters {
+    unsigned long hits, misses, replayed, evicted;
+};
+
+void cache_count(bool hit, size_t bytes, int evicted, struct cache_counters *out) {
+    char path[PATH_MAX + 16];
+    struct cache_counters counters = {0};
+    snprintf(path, sizeof(path), "%s/stats", cache_dir());
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1)
+        return;
+    flock(fd, LOCK_EX);
+    char text[256];
+    ssize_t n = pread(fd, text, sizeof(text) - 1, 0);
+    text[n > 0 ? n : 0] = 0;
+    sscanf(text, "%lu %lu %lu %lu", &counters.hits, &counters.misses, &counters.replayed, &counters.evicted);
+    if (out != NULL) {
+        *out = counters;
+    } else {
+        counters.hits += hit;
+        counters.misses += !hit;
+        counters.replayed += hit ? bytes : 0;
+        counters.evicted += evicted;
+        n = snprintf(text, sizeof(text), "%lu %lu %lu %lu\n", counters.hits, counters.misses, counters.replayed,
+                     counters.evicted);
+        if (pwrite(fd, text, n, 0) == n)
+            ftruncate(fd, n);
+    }
+    close(fd);
+}
+
+struct cache_key {
+    char name[33];
+    struct timespec used;
+    off_t size; // of its object
+    char object[33];
+};
+
+int compare_cache_keys(const void *a, const void *b) {
+    const struct timespec *x = &((const struct cache_key *) a)->used, *y = &((const struct cache_key *) b)->used;
+    return x->tv_sec != y->tv_sec ? (x->tv_sec < y->tv_sec ? -1 : 1) : (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+int compare_object_names(const void *a, const void *b) {
+    return strcmp((const char *) a, (const char *) b);
+}
+
+/**
+ * Read every key of the store with the size of the object it points to.
+ * @param  objects set to the object names, sorted and unique
+ * @param  total   set to the size of all objects
+ * @return         the keys, oldest use first
+ */
+struct cache_key *cache_scan(int *count, char (**objects)[33], int *object_count, off_t *total) {
+    char path[PATH_MAX + 64];
+    struct cache_key *keys = NULL;
+    int capacity = 0;
+    *count = 0;
+    *total = 0;
+    snprintf(path, sizeof(path), "%s/keys", cache_dir());
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (strlen(entry->d_name) != 32)
+            continue;
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            keys = realloc(keys, sizeof(struct cache_key) * capacity);
+        }
+        struct cache_key *key = &keys[*count];
+        struct stat st;
+        int status;
+        snprintf(path, sizeof(path), "%s/keys/%s", cache_dir(), entry->d_name);
+        FILE *file = fopen(path, "r");
+        if (file == NULL)
+            continue;
+        bool valid = fstat(fileno(file), &st) == 0 && fscanf(file, "%d %ld %32s", &status, &key->size, key->object) == 3;
+        fclose(file);
+        if (!valid)
+            continue;
+        strcpy(key->name, entry->d_name);
+        key->used = st.st_mtim;
+        (*count)++;
+    }
+    if (dir)
+        closedir(dir);
+    qsort(keys, *count, sizeof(struct cache_key), compare_cache_keys);
+
+    *objects = malloc(33 * (*count + 1));
+    *object_count = 0;
+    for (int i = 0; i < *count; ++i)
+        strcpy((*objects)[(*object_count)++], keys[i].object);
+    qsort(*objects, *object_count, 33, compare_object_names);
+    int unique = 0;
+    for (int i = 0; i < *object_count; ++i) {
+        if (unique > 0 && strcmp((*objects)[unique - 1], (*objects)[i]) == 0)
+            continue;
+        if (unique != i)
+            strcpy((*objects)[unique], (*objects)[i]);
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/objects/%s", cache_dir(), (*objects)[unique++]);
+        if (stat(path, &st) == 0)
+            *total += st.st_size;
+    }
+    *object_count = unique;
+    return keys;
+}
+
+// drops the least recently used keys until the store fits, then their orphaned objects
+int cache_evict() {
+    int count, object_count, evicted = 0;
+    char (*objects)[33];
+    off_t total, limit = (off_t) cache_limit << 20;
+    struct cache_key *keys = cache_scan(&count, &objects, &object_count, &total);
+    char path[PATH_MAX + 64];
+    for (int i = 0; i < count && total > limit; ++i) {
+        snprintf(path, sizeof(path), "%s/keys/%s", cache_dir(), keys[i].name);
+        unlink(path);
+        evicted++;
+        // the object goes with its last key
+        bool shared = false;
+        for (int j = i + 1; j < count && !shared; ++j)
+            shared = strcmp(keys[j].object, keys[i].object) == 0;
+        if (!shared) {
+            snprintf(path, sizeof(path), "%s/objects/%s", cache_dir(), keys[i].object);
+            unlink(path);
+            total -= keys[i].size;
+        }
+    }
+    free(keys);
+    free(objects);
+    return evicted;
+}
+
+int cache_stats() {
+    struct cache_counters counters;
+    int count, object_count;
+    char (*objects)[33];
+    off_t total;
+    struct cache_key *keys = cache_scan(&count, &objects, &object_count, &total);
+    cache_count(false, 0, 0, &counters);
+    printf("store:    %s\n", cache_dir());
+    printf("entries:  %d commands, %d outputs\n", count, object_count);
+    printf("size:     %.1f of %d MB\n", total / 1048576.0, cache_limit);
+    printf("hits:     %lu\n", counters.hits);
+    printf("misses:   %lu\n", counters.misses);
+    if (counters.hits + counters.misses > 0)
+        printf("hit rate: %.1f%%\n", 100.0 * counters.hits / (counters.hits + counters.misses));
+    printf("replayed: %.1f MB\n", counters.replayed / 1048576.0);
+    printf("evicted:  %lu\n", counters.evicted);
+    free(keys);
+    free(objects);
+    return SUCCESS;
+}
+
+// opens where the output of the whole line goes: the last stage's > or >> file, or our stdout
+int cache_output(const struct redirect *out) {
+    if (out == NULL)
+        return STDOUT_FILENO;
+    int fd = open(out->target, O_WRONLY | O_CREAT | O_CLOEXEC | (out->type == REDIRECT_OUT ? O_TRUNC : O_APPEND), 0644);
+    if (fd == -1)
+        printf("-%s: %s: %s\n", sysname, out->target, strerror(errno));
+    return fd;
+}
+
+/**
+ * cache [-i file]... [-e VAR]... command...   run through the cache
+ * cache stats | cache clear
+ * Arguments that name existing files and a < file are inputs without -i.
+ * A hit replays the stored output with sendfile() and sets the stored exit
+ * status; a miss runs the line with its stdout captured in the store and
+ * then replays it the same way.
+ */
+int cache_command(struct command_t *command) {
+    shift_command(command);
+    if (cache_dir() == NULL) {
+        printf("-%s: cache: neither XDG_CACHE_HOME nor HOME is set\n", sysname);
+        last_status = UNKNOWN;
+        return SUCCESS;
+    }
+    if (command->next == NULL && command->arg_count == 0 && command->name && strcmp(command->name, "stats") == 0) {
+        last_status = cache_stats();
+        return SUCCESS;
+    }
+    if (command->next == NULL && command->arg_count == 0 && command->name && strcmp(command->name, "clear") == 0) {
+        int limit = cache_limit;
+        cache_limit = 0;
+        cache_evict();
+        cache_limit = limit;
+        last_status = SUCCESS;
+        return SUCCESS;
+    }
+
+    struct digest key;
+    digest_init(&key);
+    while (command->name && command->name[0] == '-' && command->arg_count > 0
+           && (strcmp(command->name, "-i") == 0 || strcmp(command->name, "-e") == 0)) {
+        struct stat st;
+        const char *value = command->args[0];
+        digest_string(&key, command->name);
+        digest_string(&key, value);
+        if (command->name[1] == 'e') {
+            digest_string(&key, getenv(value));
+        } else if (stat(value, &st) == 0) {
+            digest_update(&key, &st.st_size, sizeof(st.st_size));
+            digest_update(&key, &st.st_mtim, sizeof(st.st_mtim));
+        }
+        shift_command(command);
+        shift_command(command);
+    }
+    if (command->name == NULL || command->name[0] == 0) {
+        printf("-%s: cache: usage: cache [-i file]... [-e VAR]... command... | cache stats | cache clear\n",
+               sysname);
+        last_status = UNKNOWN;
+        return SUCCESS;
+    }
+    struct command_t *last = command;
+    while (last->next)
+        last = last->next;
+    if (command->background || last->tee_output) // nothing to capture in the shell
+        return process_command(command);
+
+    char cwd[PATH_MAX];
+    digest_string(&key, getcwd(cwd, sizeof(cwd)));
+    for (struct command_t *c = command; c; c = c->next) {
+        digest_string(&key, "|");
+        for (int i = 0; c->argv[i]; ++i) {
+            struct stat st;
+            digest_string(&key, c->argv[i]);
+            if (i > 0 && stat(c->argv[i], &st) == 0 && S_ISREG(st.st_mode)) {
+                digest_update(&key, &st.st_size, sizeof(st.st_size));
+                digest_update(&key, &st.st_mtim, sizeof(st.st_mtim));
+            }
+        }
+        for (struct redirect *r = c->redirects; r; r = r->next) {
+            struct stat st;
+            if (r->type == REDIRECT_IN && stat(r->target, &st) == 0) {
+                digest_string(&key, r->target);
+                digest_update(&key, &st.st_size, sizeof(st.st_size));
+                digest_update(&key, &st.st_mtim, sizeof(st.st_mtim));
+            } else if (r->type == REDIRECT_HERE) {
+                digest_update(&key, r->target, r->len);
+            }
+        }
+    }
+    char name[33], path[PATH_MAX + 64], object_path[PATH_MAX + 80];
+    digest_hex(&key, name);
+    snprintf(path, sizeof(path), "%s/keys/%s", cache_dir(), name);
+
+    // the line's own output redirection applies to the replay, not to the capture
+    struct redirect *out = NULL;
+    for (struct redirect **r = &last->redirects; *r;) {
+        if (((*r)->type == REDIRECT_OUT || (*r)->type == REDIRECT_APPEND) && (*r)->fd == STDOUT_FILENO) {
+            out = *r;
+            *r = (*r)->next;
+        } else {
+            r = &(*r)->next;
+        }
+    }
+
+    int status;
+    off_t size;
+    char object[33];
+    FILE *entry = fopen(path, "r");
+    if (entry != NULL) {
+        bool valid = fscanf(entry, "%d %ld %32s", &status, &size, object) == 3;
+        fclose(entry);
+        snprintf(object_path, sizeof(object_path), "%s/objects/%s", cache_dir(), object);
+        int object_fd = valid ? open(object_path, O_RDONLY | O_CLOEXEC) : -1;
+        if (object_fd != -1) {
+            int out_fd = cache_output(out);
+            fflush(stdout);
+            if (out_fd != -1)
+                send_file_all(out_fd, object_fd, size);
+            if (out_fd > STDOUT_FILENO)
+                close(out_fd);
+            close(object_fd);
+            utimensat(AT_FDCWD, path, NULL, 0); // used now
+            cache_count(true, size, 0, NULL);
+            last_status = out_fd == -1 ? 1 : status;
+            return SUCCESS;
+        }
+    }
+
+    // miss: run the line with stdout going into a new file in the store
+    snprintf(object_path, sizeof(object_path), "%s/objects/capture.XXXXXX", cache_dir());
+    int capture_fd = mkostemp(object_path, O_CLOEXEC);
+    if (capture_fd == -1) {
+        printf("-%s: cache: %s: %s\n", sysname, object_path, strerror(errno));
+        return process_command(command);
+    }
+    fflush(stdout);
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(capture_fd, STDOUT_FILENO);
+    int code = process_command(command);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    status = last_status;
+
+    size = lseek(capture_fd, 0, SEEK_END);
+    struct digest content;
+    digest_init(&content);
+    void *data = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, capture_fd, 0) : NULL;
+    if (data != NULL && data != MAP_FAILED) {
+        digest_update(&content, data, size);
+        munmap(data, size);
+    }
+    digest_hex(&content, object);
+    char stored[PATH_MAX + 64];
+    snprintf(stored, sizeof(stored), "%s/objects/%s", cache_dir(), object);
+    rename(object_path, stored); // an equal output already there is simply replaced
+
+    // keys are written whole and renamed, so a reader never sees half of one
+    snprintf(object_path, sizeof(object_path), "%s.new", path);
+    entry = fopen(object_path, "w");
+    if (entry != NULL) {
+        fprintf(entry, "%d %ld %s\n", status, (long) size, object);
+        fclose(entry);
+        rename(object_path, path);
+    }
+
+    int out_fd = cache_output(out);
+    if (out_fd != -1)
+        send_file_all(out_fd, capture_fd, size);
+    if (out_fd > STDOUT_FILENO)
+        close(out_fd);
+    close(capture_fd);
+    cache_count(false, 0, cache_evict(), NULL);
+    last_status = out_fd == -1 ? 1 : status;
+    return code;
+}
+
+/**
+ * Run a builtin in the shell process. Its redirections are applied to our own
+ * stdin/stdout and undone afterwards from saved copies of the descriptors.
+ * @param  command the builtin with its arguments
+ * @return         its exit status
+ */
+int run_builtin(struct command_t *command, const struct builtin *builtin) {
+    struct saved_fds saved = {0};
+    int status = 1;
+    fflush(stdout); // earlier output belongs to the old stdout
+    if (apply_redirects(command, &saved) == 0) {
+        uint64_t start = stats_enabled ? now_ns() : 0;
+        status = builtin->run(command);
+        if (stats_enabled && start) // not for the "set stats on" that turned it on
+            stats_record(STAT_EXEC, now_ns() - start);
+    }
+    fflush(stdout);
+    restore_redirects(&saved);
+    return status;
+}
+
+// a builtin or an external program, in a child that already has its redirections
+int run_program(struct command_t *command) {
+    const struct builtin *builtin = find_builtin(command->name);
+    if (builtin != NULL && (builtin->flags & BUILTIN_PREFIX)) {
+        command->next = NULL; // only this stage, it runs as a pipeline of its own
+        builtin->run(command);
+        return last_status;
+    }
+    if (builtin != NULL) {
+        int status = builtin->run(command);
+        fflush(stdout);
+        return status;
+    }
+    execute(command);
+    return 127; // exec failed
+}
+
+// runs one stage of a pipeline in its forked child and never returns
+void run_stage(struct command_t *command) {
+    if (command->redirects != NULL)
+        redirection_command(command);
+    exit(run_program(command));
+}
+
+// exit status of every stage of the last foreground pipeline
+int *pipe_status = NULL;
+int pipe_status_count = 0;
+
+// records the per-stage exit statuses, also exported as $PIPESTATUS
+void set_pipe_status(int *statuses, int count) {
+    char value[1024];
+    size_t used = 0;
+    pipe_status = realloc(pipe_status, sizeof(int) * count);
+    pipe_status_count = count;
+    value[0] = 0;
+    for (int i = 0; i < count; ++i) {
+        pipe_status[i] = statuses[i];
+        if (used < sizeof(value))
+            used += snprintf(value + used, sizeof(value) - used, i ? " %d" : "%d", statuses[i]);
+    }
+    setenv("PIPESTATUS", value, 1);
+}
+
+// Launch settings. The pin, nice, ionice and rlimit prefixes record on the
+// command how its processes are to be started, and every stage applies them
+// in the child right before it execs, so none of taskset, nice or prlimit is
+// launched on the way. A job keeps the settings it was started with, and the
+// same prefixes given a %job change a running job and its record.
+
+#define LAUNCH_RLIMITS 8
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+struct launch_settings {
+    bool pin;
+    cpu_set_t cpus;
+    bool nice;
+    int niceness; // absolute, the shell's own plus the prefix's increment
+    bool ionice;
+    int ioprio; // class << IOPRIO_CLASS_SHIFT | level, as ioprio_set() takes it
+    int rlimit_count;
+    struct {
+        int resource;
+        struct rlimit limit;
+    } rlimits[LAUNCH_RLIMITS];
+};
+
+static const struct {
+    const char *name;
+    int resource;
+} rlimit_names[] = {
+        {"as", RLIMIT_AS}, {"core", RLIMIT_CORE}, {"cpu", RLIMIT_CPU}, {"data", RLIMIT_DATA},
+        {"fsize", RLIMIT_FSIZE}, {"memlock", RLIMIT_MEMLOCK}, {"nofile", RLIMIT_NOFILE},
+        {"nproc", RLIMIT_NPROC}, {"rss", RLIMIT_RSS}, {"stack", RLIMIT_STACK},
+        {"rtprio", RLIMIT_RTPRIO}, {"msgqueue", RLIMIT_MSGQUEUE},
+};
+
+static const char *const ioprio_class_names[] = {"none", "rt", "be", "idle"};
+
+// "0-3,8,10-11" into the set, false if it is malformed or empty
+bool parse_cpu_list(const char *list, cpu_set_t *cpus) {
+    CPU_ZERO(cpus);
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long low = strtol(p, &end, 10), high = low;
+        if (end == p)
+            return false;
+        if (*end == '-') {
+            p = end + 1;
+            high = strtol(p, &end, 10);
+            if (end == p)
+                return false;
+        }
+        if (low < 0 || high < low || high >= CPU_SETSIZE)
+            return false;
+        for (long cpu = low; cpu <= high; ++cpu)
+            CPU_SET(cpu, cpus);
+        if (*end == ',')
+            end++;
+        else if (*end != 0)
+            return false;
+        p = end;
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+// a cpu list, or "nodeN" for the CPUs of a NUMA node as sysfs lists them
+bool parse_pin(const char *arg, cpu_set_t *cpus) {
+    if (strncmp(arg, "node", 4) != 0)
+        return parse_cpu_list(arg, cpus);
+    char path[64], list[4096];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%s/cpulist", arg + 4);
+    int fd = strspn(arg + 4, "0123456789") == strlen(arg + 4) ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd == -1)
+        return false;
+    ssize_t n = read(fd, list, sizeof(list) - 1);
+    close(fd);
+    list[n > 0 ? n : 0] = 0;
+    list[strcspn(list, "\n")] = 0;
+    return parse_cpu_list(list, cpus);
+}
+
+// "be", "be:2", "rt:0", "idle" or a class number with an optional level
+bool parse_ioprio(const char *arg, int *ioprio) {
+    size_t len = strcspn(arg, ":");
+    int class = -1, level = 4;
+    for (int i = 0; i < 4; ++i)
+        if (strlen(ioprio_class_names[i]) == len && strncmp(arg, ioprio_class_names[i], len) == 0)
+            class = i;
+    if (len == 1 && arg[0] >= '0' && arg[0] <= '3')
+        class = arg[0] - '0';
+    if (arg[len] == ':') {
+        char *end;
+        level = strtol(arg + len + 1, &end, 10);
+        if (end == arg + len + 1 || *end != 0 || level < 0 || level > 7)
+            return false;
+    }
+    if (class == -1)
+        return false;
+    *ioprio = class << IOPRIO_CLASS_SHIFT | (class == 3 ? 0 : level);
+    return true;
+}
+
+// a limit value: a number with an optional K, M or G, or "unlimited"
+bool parse_rlim(const char *s, const char *end, rlim_t *value) {
+    if ((size_t) (end - s) == 9 && strncmp(s, "unlimited", 9) == 0) {
+        *value = RLIM_INFINITY;
+        return true;
+    }
+    char *stop;
+    unsigned long long n = strtoull(s, &stop, 10);
+    if (stop == s || *s == '-')
+        return false;
+    const char *suffix = strchr("KMG", *stop);
+    if (*stop != 0 && suffix != NULL && stop + 1 == end) {
+        n <<= 10 * (suffix - "KMG" + 1);
+        stop++;
+    }
+    *value = n;
+    return stop == end;
+}
+
+// "nofile=1024" sets both limits, "nofile=1024:4096" the soft and the hard one
+bool parse_rlimit(const char *arg, struct launch_settings *settings) {
+    size_t len = strcspn(arg, "=");
+    if (arg[len] != '=')
+        return false;
+    int resource = -1;
+    for (size_t i = 0; i < sizeof(rlimit_names) / sizeof(rlimit_names[0]); ++i)
+        if (strlen(rlimit_names[i].name) == len && strncmp(arg, rlimit_names[i].name, len) == 0)
+            resource = rlimit_names[i].resource;
+    const char *soft = arg + len + 1, *colon = strchr(soft, ':');
+    struct rlimit limit;
+    if (resource == -1 || !parse_rlim(soft, colon ? colon : soft + strlen(soft), &limit.rlim_cur))
+        return false;
+    limit.rlim_max = limit.rlim_cur;
+    if (colon && !parse_rlim(colon + 1, colon + strlen(colon), &limit.rlim_max))
+        return false;
+    int i = 0;
+    while (i < settings->rlimit_count && settings->rlimits[i].resource != resource)
+        i++;
+    if (i == LAUNCH_RLIMITS)
+        return false;
+    if (i == settings->rlimit_count)
+        settings->rlimit_count++;
+    settings->rlimits[i].resource = resource;
+    settings->rlimits[i].limit = limit;
+    return true;
+}
+
+// copies what src sets over dst
+void launch_settings_merge(struct launch_settings *dst, const struct launch_settings *src) {
+    if (src->pin) {
+        dst->pin = true;
+        dst->cpus = src->cpus;
+    }
+    if (src->nice) {
+        dst->nice = true;
+        dst->niceness = src->niceness;
+    }
+    if (src->ionice) {
+        dst->ionice = true;
+        dst->ioprio = src->ioprio;
+    }
+    for (int i = 0; i < src->rlimit_count; ++i) {
+        int j = 0;
+        while (j < dst->rlimit_count && dst->rlimits[j].resource != src->rlimits[i].resource)
+            j++;
+        if (j == LAUNCH_RLIMITS)
+            continue;
+        if (j == dst->rlimit_count)
+            dst->rlimit_count++;
+        dst->rlimits[j] = src->rlimits[i];
+    }
+}
+
+/**
+ * Apply launch settings to a process. Only system calls and dprintf(), so it
+ * is also safe in a vfork() child.
+ * @param  pid the process, 0 for ourselves
+ * @return     0, or -1 once the first one that fails is reported
+ */
+int apply_launch_settings(const struct launch_settings *settings, pid_t pid) {
+    const char *failed = NULL;
+    if (settings->pin && sched_setaffinity(pid, sizeof(cpu_set_t), &settings->cpus) == -1)
+        failed = "pin";
+    else if (settings->nice && setpriority(PRIO_PROCESS, pid, settings->niceness) == -1)
+        failed = "nice";
+    else if (settings->ionice && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, settings->ioprio) == -1)
+        failed = "ionice";
+    for (int i = 0; failed == NULL && i < settings->rlimit_count; ++i)
+        if (prlimit(pid, settings->rlimits[i].resource, &settings->rlimits[i].limit, NULL) == -1)
+            failed = "rlimit";
+    if (failed == NULL)
+        return 0;
+    const char *error = strerror(errno);
+    dprintf(STDERR_FILENO, "-%s: %s: %s\n", sysname, failed, error);
+    return -1;
+}
+
+// "\t[pin 0-3 nice 5 ...]" for job listings, empty without settings
+void launch_settings_describe(const struct launch_settings *settings, char *buf, size_t size) {
+    buf[0] = 0;
+    FILE *out = settings ? fmemopen(buf, size, "w") : NULL;
+    if (out == NULL)
+        return;
+    const char *separator = "\t[";
+    if (settings->pin) {
+        fprintf(out, "%spin ", separator);
+        for (int cpu = 0, first = 1; cpu < CPU_SETSIZE; ++cpu) {
+            if (!CPU_ISSET(cpu, &settings->cpus))
+                continue;
+            int last = cpu;
+            while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &settings->cpus))
+                last++;
+            fprintf(out, last > cpu ? "%s%d-%d" : "%s%d", first ? "" : ",", cpu, last);
+            first = 0;
+            cpu = last;
+        }
+        separator = " ";
+    }
+    if (settings->nice) {
+        fprintf(out, "%snice %d", separator, settings->niceness);
+        separator = " ";
+    }
+    if (settings->ionice) {
+        fprintf(out, "%sionice %s:%d", separator, ioprio_class_names[settings->ioprio >> IOPRIO_CLASS_SHIFT & 3],
+                settings->ioprio & 7);
+        separator = " ";
+    }
+    for (int i = 0; i < settings->rlimit_count; ++i) {
+        const char *name = "?";
+        for (size_t j = 0; j < sizeof(rlimit_names) / sizeof(rlimit_names[0]); ++j)
+            if (rlimit_names[j].resource == settings->rlimits[i].resource)
+                name = rlimit_names[j].name;
+        fprintf(out, "%srlimit %s=", separator, name);
+        const struct rlimit *limit = &settings->rlimits[i].limit;
+        for (int hard = 0; hard < 2; ++hard) {
+            rlim_t value = hard ? limit->rlim_max : limit->rlim_cur;
+            if (hard && value == limit->rlim_cur)
+                break;
+            if (hard)
+                fputc(':', out);
+            if (value == RLIM_INFINITY)
+                fputs("unlimited", out);
+            else
+                fprintf(out, "%llu", (unsigned long long) value);
+        }
+        separator = " ";
+    }
+    if (separator[0] == ' ')
+        fputc(']', out);
+    fclose(out);
+}
+
+enum job_state {
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE,
+};
+
+struct job;
+
+// one process of a job, also a node in the pid -> job table
+struct job_process {
+    pid_t pid;
+    int stage;
+    bool exited;
+    struct job *job;
+    struct job_process *next; // next in the same pid bucket
+};
+
+// a pipeline started by the shell, all of its processes share one process group
+struct job {
+    int id;
+    pid_t pgid;
+    enum job_state state;
+    bool background;
+    bool notified; // the user was told about the current state
+    int process_count;
+    int live; // processes that have not exited yet
+    struct job_process *processes;
+    int *statuses; // exit status per stage
+    uint64_t done_ns; // when the last process exited, with stats on
+    char *command_line;
+    struct launch_settings *launch; // applied to every stage, NULL if none
+    struct job *next;
+};
+
+#define JOB_PID_BUCKETS 1024
+
+struct job *jobs = NULL; // newest first
+uint64_t job_done_ns; // when the last job waited for finished, 0 if it stopped or stats are off
+struct job_process *job_pid_table[JOB_PID_BUCKETS];
+bool job_control = false; // stdin is a terminal we can hand to foreground jobs
+pid_t shell_pgid;
+
+// blocks SIGCHLD into a signalfd and, on a terminal, takes control of it
+void init_jobs() {
+    // an interactive shell gets SIGINT through the signalfd instead of ignoring it
+    init_events(isatty(STDIN_FILENO));
+
+    if (!isatty(STDIN_FILENO))
+        return;
+    shell_pgid = getpid();
+    if (getpgrp() != shell_pgid)
+        setpgid(0, shell_pgid);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    job_control = true;
+}
+
+// undoes init_jobs() in a child before it execs
+void reset_child_signals() {
+    sigset_t mask;
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+// the command line as typed, for job listings
+char *command_line(struct command_t *command) {
+    size_t len = 1;
+    for (struct command_t *c = command; c; c = c->next) {
+        len += strlen(c->name) + 3;
+        for (int i = 0; i < c->arg_count; ++i)
+            len += strlen(c->args[i]) + 1;
+    }
+    char *line = malloc(len);
+    line[0] = 0;
+    for (struct command_t *c = command; c; c = c->next) {
+        strcat(line, c->name);
+        for (int i = 0; i < c->arg_count; ++i) {
+            strcat(line, " ");
+            strcat(line, c->args[i]);
+        }
+        if (c->next)
+            strcat(line, " | ");
+    }
+    return line;
+}
+
+struct job *create_job(struct command_t *command, int process_count) {
+    struct job *job = calloc(1, sizeof(struct job));
+    job->id = jobs ? jobs->id + 1 : 1;
+    job->state = JOB_RUNNING;
+    job->background = command->background;
+    job->processes = calloc(process_count, sizeof(struct job_process));
+    job->statuses = calloc(process_count, sizeof(int));
+    job->command_line = command_line(command);
+    if (command->launch) {
+        job->launch = malloc(sizeof(struct launch_settings));
+        *job->launch = *command->launch;
+    }
+    job->next = jobs;
+    jobs = job;
+    return job;
+}
+
+// registers a started process, pid == -1 records a stage that failed to launch
+void job_add_process(struct job *job, pid_t pid) {
+    struct job_process *p = &job->processes[job->process_count];
+    p->stage = job->process_count++;
+    p->job = job;
+    if (pid <= 0) {
+        p->exited = true;
+        job->statuses[p->stage] = 127;
+        return;
+    }
+    p->pid = pid;
+    if (job->pgid == 0)
+        job->pgid = pid;
+    job->live++;
+    p->next = job_pid_table[pid % JOB_PID_BUCKETS];
+    job_pid_table[pid % JOB_PID_BUCKETS] = p;
+}
+
+void free_job(struct job *job) {
+    struct job **link = &jobs;
+    while (*link && *link != job)
+        link = &(*link)->next;
+    if (*link)
+        *link = job->next;
+    for (int i = 0; i < job->process_count; ++i) {
+        struct job_process *p = &job->processes[i];
+        if (p->pid <= 0)
+            continue;
+        struct job_process **bucket = &job_pid_table[p->pid % JOB_PID_BUCKETS];
+        while (*bucket && *bucket != p)
+            bucket = &(*bucket)->next;
+        if (*bucket)
+            *bucket = p->next;
+    }
+    free(job->processes);
+    free(job->statuses);
+    free(job->command_line);
+    free(job->launch);
+    free(job);
+}
+
+// applies one waitpid() result to the job owning pid, O(1) through the pid table
+// records a state change of a child, returns the job it belongs to or NULL
+struct job *job_update(pid_t pid, int status) {
+    struct job_process *p = job_pid_table[pid % JOB_PID_BUCKETS];
+    while (p && p->pid != pid)
+        p = p->next;
+    if (p == NULL)
+        return NULL;
+    struct job *job = p->job;
+    if (WIFSTOPPED(status)) {
+        job->state = JOB_STOPPED;
+        job->notified = false;
+    } else if (WIFCONTINUED(status)) {
+        job->state = JOB_RUNNING;
+    } else if (!p->exited) {
+        p->exited = true;
+        job->statuses[p->stage] = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        if (--job->live == 0) {
+            job->state = JOB_DONE;
+            job->notified = false;
+            if (stats_enabled)
+                job->done_ns = now_ns();
+        }
+    }
+    return job;
+}
+
+// collects every child that changed state, called whenever the signalfd is readable
+void reap_jobs() {
+    read_signals(); // children are found by wait4, the signals only say when to look
+    child_changed = false;
+    int status;
+    pid_t pid;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        struct job *job = job_update(pid, status);
+        if (job && !job->background && (WIFEXITED(status) || WIFSIGNALED(status)))
+            rusage_add(&child_usage, &usage);
+    }
+}
+
+// whether notify_jobs() has something to print
+bool jobs_need_notice() {
+    for (struct job *job = jobs; job; job = job->next)
+        if (!job->notified && (job->state == JOB_DONE || job->state == JOB_STOPPED))
+            return true;
+    return false;
+}
+
+// prints finished and newly stopped background jobs, forgets the finished ones
+void notify_jobs() {
+    reap_jobs();
+    struct job *job = jobs;
+    while (job) {
+        struct job *next = job->next;
+        if (!job->notified && job->state == JOB_DONE) {
+            if (interactive)
+                printf("[%d]  Done\t\t%s\n", job->id, job->command_line);
+            free_job(job);
+        } else if (!job->notified && job->state == JOB_STOPPED) {
+            printf("[%d]+ Stopped\t\t%s\n", job->id, job->command_line);
+            job->notified = true;
+        }
+        job = next;
+    }
+}
+
+/**
+ * Give the terminal to a job and wait until all of its processes exit or it stops.
+ * @return exit status of the last stage, or 128 + SIGTSTP if it stopped
+ */
+int wait_for_job(struct job *job) {
+    job->background = false;
+    if (job_control && job->pgid > 0)
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    // with the event loop, alarms keep ringing while the job runs
+    while (events_fd != -1 && job->live > 0 && job->state != JOB_STOPPED) {
+        reap_jobs();
+        if (job->live > 0 && job->state != JOB_STOPPED)
+            run_events(-1);
+    }
+    while (job->live > 0 && job->state != JOB_STOPPED) {
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-job->pgid, &status, WUNTRACED, &usage);
+        if (pid == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+            rusage_add(&child_usage, &usage);
+        job_update(pid, status);
+    }
+    if (job_control)
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+
+    job_done_ns = job->done_ns;
+    if (job->state == JOB_STOPPED) {
+        job_done_ns = 0;
+        job->background = true;
+        job->notified = true;
+        printf("\n[%d]+ Stopped\t\t%s\n", job->id, job->command_line);
+        return 128 + SIGTSTP;
+    }
+    int status = job->statuses[job->process_count - 1];
+    if (status == 128 + SIGINT)
+        printf("\n"); // ^C was echoed without a newline
+    set_pipe_status(job->statuses, job->process_count);
+    free_job(job);
+    return status;
+}
+
+// finds a job from "%n" or "n"
+struct job *find_job_spec(const char *spec) {
+    if (spec[0] == '%')
+        spec++;
+    int id = atoi(spec);
+    for (struct job *job = jobs; job; job = job->next)
+        if (job->id == id)
+            return job;
+    return NULL;
+}
+
+// finds the job named by the first argument or, without one, the most recent job
+struct job *find_job(struct command_t *command) {
+    return command->arg_count == 0 ? jobs : find_job_spec(command->args[0]);
+}
+
+static const struct {
+    const char *name, *usage;
+} launch_usage[] = {
+        {"pin", "pin <cpulist|nodeN> command...|%job"},
+        {"nice", "nice [-n] [n] command...|%job"},
+        {"ionice", "ionice <rt|be|idle>[:level] command...|%job"},
+        {"rlimit", "rlimit <resource>=<soft>[:<hard>]... command...|%job"},
+};
+
+/**
+ * pin <cpulist|nodeN> command...    only on those CPUs, or the CPUs of a NUMA node
+ * nice [-n] [n] command...         at the shell's niceness plus n, 10 by default
+ * ionice <class>[:level] command... in the I/O scheduling class rt, be or idle
+ * rlimit <resource>=<soft>[:<hard>]... command...
+ * The settings go with the command to every stage of its pipeline, and the
+ * prefixes combine. With %job in place of a command they are applied to the
+ * live processes of that job and recorded as its settings.
+ */
+int launch_prefix(struct command_t *command) {
+    struct launch_settings settings;
+    memset(&settings, 0, sizeof(settings));
+    const char *name = command->name;
+    int used = 1;
+    bool valid = command->arg_count > 0;
+    if (valid && strcmp(name, "pin") == 0) {
+        settings.pin = valid = parse_pin(command->args[0], &settings.cpus);
+    } else if (strcmp(name, "nice") == 0) {
+        // the forms of nice(1) too: no adjustment for 10, -n N, -nN, --adjustment=N and -N
+        const char *arg = command->arg_count > 0 ? command->args[0] : NULL, *value = "10";
+        used = 0;
+        if (arg == NULL) { // like nice(1), print the niceness
+            printf("%d\n", getpriority(PRIO_PROCESS, 0));
+            last_status = SUCCESS;
+            return SUCCESS;
+        } else if (strcmp(arg, "-n") == 0 || strcmp(arg, "--adjustment") == 0) {
+            value = command->arg_count > 1 ? command->args[1] : "";
+            used = 2;
+        } else if (strncmp(arg, "-n", 2) == 0 || strncmp(arg, "--adjustment=", 13) == 0) {
+            value = arg[1] == 'n' ? arg + 2 : arg + 13;
+            used = 1;
+        } else if (arg[0] == '-' || (arg[0] >= '0' && arg[0] <= '9')) {
+            value = arg + (arg[0] == '-');
+            used = 1;
+        }
+        char *end;
+        long niceness = getpriority(PRIO_PROCESS, 0) + strtol(value, &end, 10);
+        settings.nice = valid = end != value && *end == 0;
+        settings.niceness = niceness < -20 ? -20 : niceness > 19 ? 19 : niceness;
+    } else if (valid && strcmp(name, "ionice") == 0) {
+        settings.ionice = valid = parse_ioprio(command->args[0], &settings.ioprio);
+    } else if (valid) { // rlimit takes every resource=value that comes first
+        used = 0;
+        while (valid && used < command->arg_count && strchr(command->args[used], '=') != NULL)
+            valid = parse_rlimit(command->args[used++], &settings);
+        valid = valid && used > 0;
+    }
+    if (!valid || used >= command->arg_count) {
+        for (size_t i = 0; i < sizeof(launch_usage) / sizeof(launch_usage[0]); ++i)
+            if (strcmp(launch_usage[i].name, name) == 0)
+                printf("-%s: %s: usage: %s\n", sysname, name, launch_usage[i].usage);
+        last_status = UNKNOWN;
+        return SUCCESS;
+    }
+
+    const char *target = command->args[used];
+    if (target[0] == '%' && used + 1 == command->arg_count && command->next == NULL) {
+        if (command->launch) { // "pin 0 nice 5 %1" has both
+            launch_settings_merge(command->launch, &settings);
+            settings = *command->launch;
+        }
+        reap_jobs();
+        struct job *job = find_job_spec(target);
+        if (job == NULL || job->state == JOB_DONE) {
+            printf("-%s: %s: %s: no such job\n", sysname, name, target);
+            last_status = UNKNOWN;
+            return SUCCESS;
+        }
+        for (int i = 0; i < job->process_count; ++i) {
+            if (!job->processes[i].exited && apply_launch_settings(&settings, job->processes[i].pid) == -1) {
+                last_status = UNKNOWN;
+                return SUCCESS;
+            }
+        }
+        last_status = SUCCESS;
+        if (job->launch == NULL)
+            job->launch = calloc(1, sizeof(struct launch_settings));
+        launch_settings_merge(job->launch, &settings);
+        return SUCCESS;
+    }
+
+    for (int i = 0; i <= used; ++i)
+        shift_command(command);
+    if (command->launch == NULL) {
+        command->launch = arena_alloc(&parse_arena, sizeof(struct launch_settings));
+        memset(command->launch, 0, sizeof(struct launch_settings));
+    }
+    launch_settings_merge(command->launch, &settings);
+    return process_command(command);
+}
+
+
+pid_t vfork_external(struct command_t *command, const char *path, char **argv, int in_fd, int out_fd, pid_t pgid,
+                     const struct launch_settings *launch);
+
+/**
+ * Start an external command with posix_spawn(), which clones without copying
+ * our page tables. Files and here data are opened here, in the order they were
+ * written, and handed over as dup2 actions; they sit above every descriptor the
+ * redirections target, so no action replaces one before it is used. When one
+ * cannot be opened the command is vforked instead, whose child reports it and
+ * exits 1 like the other backends.
+ */
+pid_t spawn_external(struct command_t *command, const char *path, char **argv, int in_fd, int out_fd, pid_t pgid) {
+    extern char **environ;
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask, defaults;
+    pid_t pid;
+
+    // own process group, default signal handling and nothing blocked, like reset_child_signals()
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, pgid);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != -1)
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    if (out_fd != -1)
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    int redirects = 0, top = 10;
+    for (struct redirect *redirect = command->redirects; redirect; redirect = redirect->next) {
+        redirects++;
+        if (redirect->fd >= top)
+            top = redirect->fd + 1;
+    }
+    int *opened = malloc(sizeof(int) * (redirects ? redirects : 1)), open_count = 0;
+    bool failed = false;
+    for (struct redirect *redirect = command->redirects; redirect; redirect = redirect->next) {
+        if (redirect->type == REDIRECT_DUP) {
+            if (redirect->from_fd == -1)
+                posix_spawn_file_actions_addclose(&actions, redirect->fd);
+            else
+                posix_spawn_file_actions_adddup2(&actions, redirect->from_fd, redirect->fd);
+            continue;
+        }
+        int fd;
+        if (redirect->type == REDIRECT_HERE)
+            fd = here_data_fd(redirect->target, redirect->len);
+        else
+            fd = open(redirect->target, O_CLOEXEC | (redirect->type == REDIRECT_IN ? O_RDONLY : redirect->type == REDIRECT_OUT
+                                                      ? O_WRONLY | O_CREAT | O_TRUNC : O_WRONLY | O_CREAT | O_APPEND), 0644);
+        if (fd != -1 && fd < top) {
+            int high = fcntl(fd, F_DUPFD_CLOEXEC, top);
+            close(fd);
+            fd = high;
+        }
+        if (fd == -1) {
+            failed = true;
+            break;
+        }
+        opened[open_count++] = fd;
+        posix_spawn_file_actions_adddup2(&actions, fd, redirect->fd);
+    }
+
+    int r = failed ? 0 : posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    for (int i = 0; i < open_count; ++i)
+        close(opened[i]);
+    free(opened);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (failed)
+        return vfork_external(command, path, argv, in_fd, out_fd, pgid, NULL);
+    if (r != 0) {
+        fprintf(stderr, "-%s: %s: %s\n", sysname, command->name, strerror(r));
+        return -1;
+    }
+    return pid;
+}
+
+// starts an external command with vfork(), the parent sleeps until the child has exec'd
+pid_t vfork_external(struct command_t *command, const char *path, char **argv, int in_fd, int out_fd, pid_t pgid,
+                     const struct launch_settings *launch) {
+    pid_t pid = vfork();
+    if (pid == 0) {
+        setpgid(0, pgid);
+        reset_child_signals();
+        if (in_fd != -1)
+            dup2(in_fd, STDIN_FILENO);
+        if (out_fd != -1)
+            dup2(out_fd, STDOUT_FILENO);
+        // no stdio and _exit() only, the child shares our memory
+        if (apply_redirects(command, NULL) == -1)
+            _exit(1);
+        if (launch && apply_launch_settings(launch, 0) == -1)
+            _exit(126);
+        execv(path, argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+/**
+ * Start one pipeline stage with in_fd/out_fd as its stdin/stdout (-1 keeps ours).
+ * External commands with plain file redirections go through the selected launch
+ * backend; builtins, tee mode and unknown commands need a real fork().
+ * posix_spawn() cannot set affinity, priorities or limits, so a stage with
+ * launch settings is vforked instead.
+ * @param  fds       every pipe of the pipeline, closed in a forked child
+ * @param  pgid      process group to join, 0 starts a new one
+ * @param  launch    applied in the child before it execs, NULL for none
+ * @return           pid of the stage or -1
+ */
+pid_t launch_stage(struct command_t *command, int in_fd, int out_fd, int (*fds)[2], int pipe_count, pid_t pgid,
+                   const struct launch_settings *launch) {
+    const char *path = strchr(command->name, '/') != NULL ? command->name : command->path;
+
+    if (launch_backend != LAUNCH_FORK && path != NULL && !command->tee_output) {
+        if (launch_backend == LAUNCH_SPAWN && launch == NULL)
+            return spawn_external(command, path, command->argv, in_fd, out_fd, pgid);
+        return vfork_external(command, path, command->argv, in_fd, out_fd, pgid, launch);
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        setpgid(0, pgid);
+        reset_child_signals();
+        // dup2() clears O_CLOEXEC on the copies, every other pipe fd closes on exec
+        if (in_fd != -1)
+            dup2(in_fd, STDIN_FILENO);
+        if (out_fd != -1)
+            dup2(out_fd, STDOUT_FILENO);
+        for (int j = 0; j < pipe_count; ++j) {
+            close(fds[j][0]);
+            close(fds[j][1]);
+        }
+        if (launch && apply_launch_settings(launch, 0) == -1)
+            exit(126);
+        run_stage(command);
+    }
+    if (pid == -1)
+        printf("-%s: fork: %s\n", sysname, strerror(errno));
+    else
+        setpgid(pid, pgid ? pgid : pid); // also in the parent, whichever runs first wins the race
+    return pid;
+}
+
+/**
+ * Run a pipeline of any length. Every pipe is created up front, each stage is
+ * forked with only its own two ends on stdin/stdout and every other pipe fd is
+ * closed, so a reader sees EOF as soon as its writer exits. The shell then reaps
+ * all stages, not just one.
+ * @param  command first stage
+ * @return         exit status of the last stage
+ */
+int execute_pipeline(struct command_t *command) {
+    int stages = 0;
+    for (struct command_t *c = command; c; c = c->next)
+        stages++;
+
+    int (*fds)[2] = malloc(sizeof(int[2]) * (stages > 1 ? stages - 1 : 1));
+
+    for (int i = 0; i < stages - 1; ++i) {
+        if (pipe2(fds[i], O_CLOEXEC) == -1) {
+            printf("-%s: pipe: %s\n", sysname, strerror(errno));
+            for (int j = 0; j < i; ++j) {
+                close(fds[j][0]);
+                close(fds[j][1]);
+            }
+            free(fds);
+            return 1;
+        }
+        if (pipe_buffer_size > 0)
+            fcntl(fds[i][1], F_SETPIPE_SZ, pipe_buffer_size);
+    }
+
+    fflush(stdout); // children must not inherit buffered output
+    if (!command->background)
+        terminal_raw(false); // the job gets the terminal as the user configured it
+    uint64_t spawn_start = stats_enabled ? now_ns() : 0;
+    struct job *job = create_job(command, stages);
+    struct command_t *c = command;
+    for (int i = 0; i < stages; ++i, c = c->next) {
+        pid_t pid = launch_stage(c, i > 0 ? fds[i - 1][0] : -1, i < stages - 1 ? fds[i][1] : -1,
+                                 fds, stages - 1, job->pgid, job->launch);
+        job_add_process(job, pid);
+    }
+    for (int i = 0; i < stages - 1; ++i) {
+        close(fds[i][0]);
+        close(fds[i][1]);
+    }
+    free(fds);
+    uint64_t launched = stats_enabled ? now_ns() : 0;
+    if (stats_enabled)
+        stats_record(STAT_SPAWN, launched - spawn_start);
+
+    if (job->live == 0) // nothing started
+        return wait_for_job(job);
+    if (command->background) {
+        if (interactive)
+            printf("[%d] %d\n", job->id, job->pgid);
+        return SUCCESS;
+    }
+    int status = wait_for_job(job);
+    terminal_raw(true);
+    if (stats_enabled && job_done_ns) {
+        stats_record(STAT_EXEC, job_done_ns - launched);
+        stats_record(STAT_WAIT, now_ns() - job_done_ns);
+    }
+    return status;
+}
+
+int compare_alarms(const void *a, const void *b) {
+    const struct alarm_timer *x = *(struct alarm_timer *const *) a, *y = *(struct alarm_timer *const *) b;
+    return x->expires < y->expires ? -1 : x->expires > y->expires;
+}
+
+// the pending alarms, soonest first
+int alarm_list() {
+    struct alarm_timer **timers = malloc(sizeof(struct alarm_timer *) * (alarm_wheel.count + 1));
+    int count = 0;
+    for (int level = 0; level < WHEEL_LEVELS; ++level)
+        for (int slot = 0; slot < WHEEL_SLOTS; ++slot)
+            for (struct alarm_timer *t = alarm_wheel.slots[level][slot]; t; t = t->next)
+                timers[count++] = t;
+    qsort(timers, count, sizeof(struct alarm_timer *), compare_alarms);
+    for (int i = 0; i < count; ++i) {
+        char when[64];
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&timers[i]->expires));
+        printf("%d\t%s\t%s\t%s\n", timers[i]->id, when, timers[i]->repeat ? "daily" : "once", timers[i]->file);
+    }
+    free(timers);
+    return SUCCESS;
+}
+
+int alarm_cancel(int id) {
+    for (int level = 0; level < WHEEL_LEVELS; ++level) {
+        for (int slot = 0; slot < WHEEL_SLOTS; ++slot) {
+            for (struct alarm_timer **t = &alarm_wheel.slots[level][slot]; *t; t = &(*t)->next) {
+                if ((*t)->id != id)
+                    continue;
+                struct alarm_timer *timer = *t;
+                *t = timer->next;
+                free(timer->file);
+                free(timer);
+                alarm_wheel.count--;
+                save_alarm_state();
+                alarm_arm();
+                return SUCCESS;
+            }
+        }
+    }
+    printf("-%s: alarm: %d: no such alarm\n", sysname, id);
+    return UNKNOWN;
+}
+
+/**
+ * alarm hh.mm[.ss] file   plays the file with mpg321 every day at that time
+ * alarm +N[s|m|h] file    plays it once, N seconds, minutes or hours from now
+ * alarm list | alarm cancel id
+ * Alarms live in the shell's timer wheel and ring while an interactive shell
+ * is running; they are kept in ~/.shellgibi_alarms unless "set alarmsave off".
+ */
+int alarm_clock(struct command_t *command) {
+    load_alarm_state();
+    alarm_expire(); // the wheel has to be at the current time before filing anything
+    if (command->arg_count == 1 && strcmp(command->args[0], "list") == 0)
+        return alarm_list();
+    if (command->arg_count == 2 && strcmp(command->args[0], "cancel") == 0)
+        return alarm_cancel(atoi(command->args[1]));
+    if (command->arg_count != 2) {
+        printf("-%s: alarm: usage: alarm hh.mm[.ss] file | alarm +N[s|m|h] file | alarm list | alarm cancel id\n",
+               sysname);
+        return UNKNOWN;
+    }
+
+    const char *when = command->args[0];
+    time_t now = wall_seconds(), expires;
+    int repeat = 0, time_of_day = 0;
+    char *end;
+    if (when[0] == '+') {
+        long n = strtol(when + 1, &end, 10);
+        long unit = *end == 'h' ? 3600 : *end == 'm' ? 60 : 1;
+        if (n <= 0 || end == when + 1 || (*end != 0 && (strchr("smh", *end) == NULL || end[1] != 0))) {
+            printf("-%s: alarm: %s: invalid delay\n", sysname, when);
+            return UNKNOWN;
+        }
+        expires = now + n * unit;
+    } else {
+        int hour = -1, minute = -1, second = 0, used = 0;
+        int fields = sscanf(when, "%d.%d%n.%d%n", &hour, &minute, &used, &second, &used);
+        if (fields < 2 || when[used] != 0 || hour < 0 || hour > 23 || minute < 0 || minute > 59
+            || second < 0 || second > 59) {
+            printf("-%s: alarm: %s: time must be hh.mm or hh.mm.ss\n", sysname, when);
+            return UNKNOWN;
+        }
+        time_of_day = hour * 3600 + minute * 60 + second;
+        expires = next_time_of_day(now, time_of_day); // today, or tomorrow if it has passed
+        repeat = 24 * 60 * 60;
+    }
+
+    char *file = realpath(command->args[1], NULL);
+    if (file == NULL) {
+        printf("-%s: alarm: %s: %s\n", sysname, command->args[1], strerror(errno));
+        return UNKNOWN;
+    }
+    struct alarm_timer *timer = malloc(sizeof(struct alarm_timer));
+    timer->id = alarm_wheel.next_id++;
+    timer->expires = expires;
+    timer->repeat = repeat;
+    timer->time_of_day = time_of_day;
+    timer->file = file;
+    alarm_insert(timer);
+    alarm_wheel.count++;
+    save_alarm_state();
+    alarm_arm();
+
+    char text[64];
+    strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", localtime(&expires));
+    printf("alarm %d at %s%s\n", timer->id, text, repeat ? ", daily" : "");
+    return SUCCESS;
+}
+
+// replaces the argv of a builtin that wraps an external program, the new
+// strings live in the parse arena like the rest of the command
+void rewrite_argv(struct command_t *command, const char **argv) {
+    int count = 0;
+    while (argv[count] != NULL)
+        count++;
+    command->argv = arena_alloc(&parse_arena, sizeof(char *) * (count + 1));
+    for (int i = 0; i < count; ++i)
+        command->argv[i] = arena_strndup(&parse_arena, argv[i], strlen(argv[i]));
+    command->argv[count] = NULL;
+    command->name = command->argv[0];
+    command->args = command->argv + 1;
+    command->arg_count = count - 1;
+}
+
+// if the command is only wiki, it opens the home page of wikipedia,
+// if it is something like "wiki didem" it searches for didem in wikipedia.
+// The command becomes "xdg-open <link>" and is started like any other program.
+
+int open_wikipedia(struct command_t *command) {
+    char link[200] = "https://www.wikipedia.org/wiki/";
+    if(command->argv[1] != NULL) {
+        snprintf(link, sizeof(link), "https://www.wikipedia.org/wiki/%s", command->argv[1]); //searching
+    }
+    const char *argv[] = {"xdg-open", link, NULL}; //homepage without an argument
+    rewrite_argv(command, argv);
+    return SUCCESS;
+}
+
+// for handling volume operations we used amixer command seen below,
+// the command becomes the amixer call.
+
+int handle_volume(struct command_t *command) {
+    const char *level = NULL;
+    if (command->argv[1] == NULL) {
+    } else if(strcmp(command->argv[1], "up") == 0) {
+        printf("volume is up\n");
+        level = "5%+"; // "volume up" command increases volume by 5%
+    }else if(strcmp(command->argv[1], "down") == 0) {
+        printf("volume is down\n");
+        level = "5%-"; // "volume down" command decreases volume by 5%
+    }
+    else if(strcmp(command->argv[1], "mute") == 0) {
+        printf("muted\n");
+        level = "0%"; // "volume mute" command mutes the volume alltogether
+    }
+    else if(strcmp(command->argv[1], "unmute") == 0) {
+        printf("unmuted\n");
+        level = "50%"; // "volume unmute" gets the volume to 50%
+    }
+    if (level == NULL) {
+        printf("-%s: volume: usage: volume up|down|mute|unmute\n", sysname);
+        return UNKNOWN;
+    }
+    const char *argv[] = {"amixer", "-D", "pulse", "sset", "Master", level, "--quiet", NULL};
+    rewrite_argv(command, argv);
+    return SUCCESS;
+}
+
+// lists the shell's jobs with their process group, state and launch settings
+
+int myjobs(struct command_t *command) {
+    (void) command;
+    static const char *state_names[] = {"Running", "Stopped", "Done"};
+    reap_jobs();
+    // jobs is newest first, print oldest first like bash
+    int count = 0;
+    for (struct job *job = jobs; job; job = job->next)
+        count++;
+    for (int i = count - 1; i >= 0; --i) {
+        struct job *job = jobs;
+        for (int j = 0; j < i; ++j)
+            job = job->next;
+        char settings[256];
+        launch_settings_describe(job->launch, settings, sizeof(settings));
+        printf("[%d]%c %d %-8s\t%s%s\n", job->id, job == jobs ? '+' : ' ', job->pgid,
+               state_names[job->state], job->command_line, settings);
+    }
+    return SUCCESS;
+}
+
+// continues a stopped job in the background
+
+int mybg(struct command_t *command) {
+    struct job *job = find_job(command);
+    if (job == NULL) {
+        printf("-%s: mybg: no such job\n", sysname);
+        return UNKNOWN;
+    }
+    if (kill(-job->pgid, SIGCONT) == -1) {
+        printf("-%s: mybg: %s\n", sysname, strerror(errno));
+        return UNKNOWN;
+    }
+    job->state = JOB_RUNNING;
+    job->background = true;
+    printf("[%d]+ %s &\n", job->id, job->command_line);
+    return SUCCESS;
+}
+
+// brings a job to the foreground, continuing it if it was stopped, and returns its exit status
+
+int myfg(struct command_t *command) {
+    struct job *job = find_job(command);
+    if (job == NULL) {
+        printf("-%s: myfg: no such job\n", sysname);
+        return UNKNOWN;
+    }
+    printf("%s\n", job->command_line);
+    fflush(stdout);
+    terminal_raw(false);
+    if (job_control)
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+    if (job->state == JOB_STOPPED) {
+        kill(-job->pgid, SIGCONT);
+        job->state = JOB_RUNNING;
+    }
+    last_status = wait_for_job(job);
+    terminal_raw(true);
+    return last_status; // the job's status, as if it had run in the foreground all along
+}
+
+// stops a process given its pid, or a job given %n
+
+int pause_process(struct command_t *command) {
+    if (command->arg_count == 0) {
+        printf("-%s: pause: usage: pause <pid|%%job>\n", sysname);
+        return UNKNOWN;
+    }
+    pid_t target;
+    if (command->args[0][0] == '%') {
+        struct job *job = find_job(command);
+        if (job == NULL) {
+            printf("-%s: pause: no such job\n", sysname);
+            return UNKNOWN;
+        }
+        target = -job->pgid;
+    } else {
+        target = atoi(command->args[0]);
+    }
+    if (target == 0 || kill(target, SIGSTOP) == -1) {
+        printf("-%s: pause: %s: %s\n", sysname, command->args[0], target ? strerror(errno) : "invalid pid");
+        return UNKNOWN;
+    }
+    return SUCCESS;
+}
+
+// one input of a parallel run
+struct parallel_job {
+    char *input;
+    pid_t pid;
+    int pidfd; // -1 when the kernel has no pidfd_open()
+    int out_fd; // memfd holding the output with -k, otherwise -1
+    int status;
+    bool done;
+};
+
+// the command for one input, with every {} replaced by it or the input appended
+struct command_t *parallel_stage(char **template, int count, const char *input) {
+    struct command_t *command = new_command();
+    bool replaced = false;
+    command->argv = arena_alloc(&parse_arena, sizeof(char *) * (count + 2));
+    for (int i = 0; i < count; ++i) {
+        const char *braces = strstr(template[i], "{}");
+        if (braces == NULL) {
+            command->argv[i] = template[i];
+            continue;
+        }
+        size_t prefix = braces - template[i], input_len = strlen(input), suffix = strlen(braces + 2);
+        char *arg = arena_alloc(&parse_arena, prefix + input_len + suffix + 1);
+        memcpy(arg, template[i], prefix);
+        memcpy(arg + prefix, input, input_len);
+        memcpy(arg + prefix + input_len, braces + 2, suffix + 1);
+        command->argv[i] = arg;
+        replaced = true;
+    }
+    if (!replaced)
+        command->argv[count++] = (char *) input;
+    command->argv[count] = NULL;
+    command->name = command->argv[0];
+    command->args = command->argv + 1;
+    command->arg_count = count - 1;
+    resolve_command_paths(command);
+    return command;
+}
+
+// with -k, prints the buffered output of every finished job that is next in input order
+void parallel_flush(struct parallel_job *jobs, int count, int *next) {
+    while (*next < count && jobs[*next].done) {
+        struct parallel_job *job = &jobs[*next];
+        if (job->out_fd != -1) {
+            send_file_all(STDOUT_FILENO, job->out_fd, lseek(job->out_fd, 0, SEEK_CUR));
+            close(job->out_fd);
+            job->out_fd = -1;
+        }
+        (*next)++;
+    }
+}
+
+/**
+ * parallel [-j N] [-k] command [args with {}] [::: inputs...]
+ * Runs the command once per input, which come after ::: or one per line from
+ * stdin, keeping up to N children (default: one per CPU) in flight. Finished
+ * children are noticed through their pidfds, or through the SIGCHLD signalfd on
+ * kernels without pidfd_open(), and their slot is refilled right away. With -k
+ * each job writes into its own memfd and the outputs are printed in input order.
+ * @return the number of failed jobs, at most 101 like GNU parallel
+ */
+int parallel_command(struct command_t *command) {
+    int max_running = sysconf(_SC_NPROCESSORS_ONLN);
+    bool keep_order = false;
+    int i = 0;
+    for (; i < command->arg_count && command->args[i][0] == '-'; ++i) {
+        if (strcmp(command->args[i], "-k") == 0)
+            keep_order = true;
+        else if (strcmp(command->args[i], "-j") == 0 && i + 1 < command->arg_count)
+            max_running = atoi(command->args[++i]);
+        else if (strncmp(command->args[i], "-j", 2) == 0 && command->args[i][2] != 0)
+            max_running = atoi(command->args[i] + 2);
+        else
+            break;
+    }
+    char **template = command->args + i;
+    int template_count = 0;
+    while (i + template_count < command->arg_count && strcmp(template[template_count], ":::") != 0)
+        template_count++;
+    if (template_count == 0 || max_running < 1) {
+        printf("-%s: parallel: usage: parallel [-j N] [-k] command [{}]... [::: input...]\n", sysname);
+        return UNKNOWN;
+    }
+
+    // typed inputs are echoed and end with ^D, the children get the terminal as the user configured it
+    bool raw = terminal_is_raw;
+    terminal_raw(false);
+
+    // inputs after ::: or lines from stdin, copied into the parse arena
+    struct parallel_job *jobs = NULL;
+    int count = 0, capacity = 0;
+    bool from_stdin = i + template_count == command->arg_count;
+    bool typed = from_stdin && isatty(STDIN_FILENO);
+    struct line_reader reader = {STDIN_FILENO, NULL, 0, 0, BATCH_CHUNK, false};
+    if (from_stdin)
+        reader.buf = malloc(BATCH_CHUNK);
+    for (int j = i + template_count + 1;; ++j) {
+        char *input;
+        // SIGINT is blocked in an interactive shell, so a ^C while typing only shows up in the
+        // signalfd; wait on both, the terminal hands out a line per read
+        while (typed && reader.start == reader.end && !reader.eof && !interrupt_received) {
+            struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+            if (poll(fds, 2, -1) == -1 && errno != EINTR)
+                break;
+            if (fds[1].revents & POLLIN)
+                read_signals();
+            if (fds[0].revents)
+                break;
+        }
+        if (typed && interrupt_received) {
+            printf("\n");
+            free(reader.buf);
+            free(jobs);
+            interrupt_received = false;
+            if (raw)
+                terminal_raw(true);
+            return 128 + SIGINT;
+        }
+        if (from_stdin)
+            input = read_line(&reader);
+        else
+            input = j < command->arg_count ? command->args[j] : NULL;
+        if (input == NULL)
+            break;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            jobs = realloc(jobs, sizeof(struct parallel_job) * capacity);
+        }
+        jobs[count++] = (struct parallel_job) {from_stdin ? arena_strndup(&parse_arena, input, strlen(input)) : input,
+                                               -1, -1, -1, 0, false};
+    }
+    free(reader.buf);
+
+    fflush(stdout);
+    // the children join our process group, so ^C reaches them while the shell ignores it
+    pid_t pgid = getpgrp();
+    int devnull = from_stdin ? open("/dev/null", O_RDONLY | O_CLOEXEC) : -1;
+    struct pollfd *slots = malloc(sizeof(struct pollfd) * (max_running + 1));
+    int *slot_job = malloc(sizeof(int) * max_running);
+    int running = 0, started = 0, printed = 0, failed = 0;
+    bool interrupted = false;
+
+    while (started < count || running > 0) {
+        while (running < max_running && started < count && !interrupted) {
+            struct parallel_job *job = &jobs[started++];
+            if (keep_order)
+                job->out_fd = memfd_create("parallel", MFD_CLOEXEC);
+            job->pid = launch_stage(parallel_stage(template, template_count, job->input),
+                                    devnull, job->out_fd, NULL, 0, pgid, NULL);
+            if (job->pid == -1) {
+                job->status = 127;
+                job->done = true;
+                failed++;
+                continue;
+            }
+            job->pidfd = syscall(SYS_pidfd_open, job->pid, 0);
+            slots[running].fd = job->pidfd;
+            slots[running].events = POLLIN;
+            slot_job[running++] = job - jobs;
+        }
+        if (running == 0)
+            break;
+
+        // without pidfds every slot is -1, which poll() skips, and the signalfd wakes us instead
+        slots[running].fd = signal_fd;
+        slots[running].events = POLLIN;
+        if (poll(slots, running + 1, -1) == -1 && errno != EINTR)
+            break;
+        if (slots[running].revents & POLLIN)
+            read_signals();
+        if (interrupt_received && !interrupted) { // ^C reached the workers too, start no more
+            interrupted = true;
+            printf("\n");
+            fflush(stdout);
+        }
+
+        for (int slot = 0; slot < running;) {
+            struct parallel_job *job = &jobs[slot_job[slot]];
+            struct rusage usage;
+            int status;
+            if ((job->pidfd != -1 && !(slots[slot].revents & POLLIN))
+                || wait4(job->pid, &status, job->pidfd != -1 ? 0 : WNOHANG, &usage) <= 0) {
+                slot++;
+                continue;
+            }
+            job->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            job->done = true;
+            rusage_add(&child_usage, &usage);
+            if (job->pidfd != -1)
+                close(job->pidfd);
+            if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT && !interrupted) { // SIGINT is not in the signalfd of a script
+                interrupted = true;
+                printf("\n"); // ^C was echoed without a newline
+                fflush(stdout);
+            }
+            if (job->status != 0) {
+                failed++;
+                fprintf(stderr, "-%s: parallel: %s: exit status %d\n", sysname, job->input, job->status);
+            }
+            // the last slot takes this one's place
+            slots[slot] = slots[--running];
+            slot_job[slot] = slot_job[running];
+        }
+        if (keep_order)
+            parallel_flush(jobs, count, &printed);
+    }
+
+    for (int j = started; j < count; ++j) // skipped after ^C
+        jobs[j].done = true;
+    if (keep_order)
+        parallel_flush(jobs, count, &printed);
+    if (failed > 0)
+        fprintf(stderr, "-%s: parallel: %d of %d jobs failed\n", sysname, failed, count);
+    if (devnull != -1)
+        close(devnull);
+    free(slots);
+    free(slot_job);
+    free(jobs);
+    interrupt_received = false; // a ^C meant for the workers, not for the next prompt
+    if (raw)
+        terminal_raw(true);
+    return failed < 101 ? failed : 101;
+}
+
+// Filters: match, count and head. They are builtins meant for the tail of a
+// pipeline ("| grep x | wc -l" becomes "| match x | count -l"), so they always
+// run in a forked child like any other stage and never exec. Input is read in
+// large chunks and scanned with SSE2/AVX2 loops picked at runtime, the same way
+// the lexer picks scan_special.
+
+#define FILTER_CHUNK (1 << 20)
+#define FILTER_OUT_SIZE (1 << 16)
+
+// C locale whitespace, what separates words for count -w
+bool is_space_byte(unsigned char c) {
+    return c == ' ' || (unsigned char) (c - '\t') <= '\r' - '\t';
+}
+
+size_t count_byte_scalar(const char *p, size_t len, char c) {
+    const char *end = p + len;
+    size_t n = 0;
+    while (p < end && (p = memchr(p, c, end - p)) != NULL) {
+        n++;
+        p++;
+    }
+    return n;
+}
+
+// words started in p[0, len), *in_word carries whether the previous chunk ended inside one
+size_t count_words_scalar(const char *p, size_t len, bool *in_word) {
+    size_t n = 0;
+    bool inside = *in_word;
+    for (size_t i = 0; i < len; ++i) {
+        bool space = is_space_byte(p[i]);
+        if (!space && !inside)
+            n++;
+        inside = !space;
+    }
+    *in_word = inside;
+    return n;
+}
+
+const char *find_string_scalar(const char *haystack, size_t len, const char *needle, size_t needle_len) {
+    return memmem(haystack, len, needle, needle_len);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// adds 16 matches per step into byte counters and folds them before they can wrap
+size_t count_byte_sse2(const char *p, size_t len, char c) {
+    const __m128i target = _mm_set1_epi8(c), zero = _mm_setzero_si128();
+    size_t n = 0;
+    while (len >= 16) {
+        size_t steps = len / 16 < 255 ? len / 16 : 255;
+        __m128i counts = zero;
+        for (size_t i = 0; i < steps; ++i, p += 16)
+            counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) p), target));
+        __m128i sums = _mm_sad_epu8(counts, zero);
+        n += _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+        len -= steps * 16;
+    }
+    return n + count_byte_scalar(p, len, c);
+}
+
+// a word starts at every non-space byte whose predecessor is a space
+size_t count_words_sse2(const char *p, size_t len, bool *in_word) {
+    const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), span = _mm_set1_epi8('\r' - '\t');
+    unsigned int after_space = !*in_word;
+    size_t n = 0;
+    while (len >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i control = _mm_sub_epi8(v, tab); // \t through \r become 0 through 4
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(_mm_min_epu8(control, span), control));
+        unsigned int spaces = _mm_movemask_epi8(m);
+        n += __builtin_popcount(~spaces & ((spaces << 1) | after_space) & 0xffff);
+        after_space = spaces >> 15;
+        p += 16;
+        len -= 16;
+    }
+    *in_word = !after_space;
+    return n + count_words_scalar(p, len, in_word);
+}
+
+// compares the first and the last byte of the needle at 16 positions per step,
+// only positions where both agree are checked with memcmp()
+const char *find_string_sse2(const char *haystack, size_t len, const char *needle, size_t needle_len) {
+    if (needle_len < 2)
+        return needle_len ? memchr(haystack, needle[0], len) : haystack;
+    const __m128i first = _mm_set1_epi8(needle[0]), last = _mm_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+    for (; i + needle_len - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (haystack + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (haystack + i + needle_len - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            const char *candidate = haystack + i + __builtin_ctz(mask);
+            if (memcmp(candidate + 1, needle + 1, needle_len - 2) == 0)
+                return candidate;
+            mask &= mask - 1;
+        }
+    }
+    return find_string_scalar(haystack + i, len - i, needle, needle_len);
+}
+
+__attribute__((target("avx2")))
+size_t count_byte_avx2(const char *p, size_t len, char c) {
+    const __m256i target = _mm256_set1_epi8(c), zero = _mm256_setzero_si256();
+    size_t n = 0;
+    while (len >= 32) {
+        size_t steps = len / 32 < 255 ? len / 32 : 255;
+        __m256i counts = zero;
+        for (size_t i = 0; i < steps; ++i, p += 32)
+            counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) p), target));
+        __m256i sums = _mm256_sad_epu8(counts, zero);
+        __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+        n += _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8));
+        len -= steps * 32;
+    }
+    return n + count_byte_sse2(p, len, c);
+}
+
+__attribute__((target("avx2")))
+size_t count_words_avx2(const char *p, size_t len, bool *in_word) {
+    const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t'), span = _mm256_set1_epi8('\r' - '\t');
+    uint32_t after_space = !*in_word;
+    size_t n = 0;
+    while (len >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) p);
+        __m256i control = _mm256_sub_epi8(v, tab);
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, space),
+                                    _mm256_cmpeq_epi8(_mm256_min_epu8(control, span), control));
+        uint32_t spaces = (uint32_t) _mm256_movemask_epi8(m);
+        n += __builtin_popcount(~spaces & ((spaces << 1) | after_space));
+        after_space = spaces >> 31;
+        p += 32;
+        len -= 32;
+    }
+    *in_word = !after_space;
+    return n + count_words_sse2(p, len, in_word);
+}
+
+__attribute__((target("avx2")))
+const char *find_string_avx2(const char *haystack, size_t len, const char *needle, size_t needle_len) {
+    if (needle_len < 2)
+        return needle_len ? memchr(haystack, needle[0], len) : haystack;
+    const __m256i first = _mm256_set1_epi8(needle[0]), last = _mm256_set1_epi8(needle[needle_len - 1]);
+    size_t i = 0;
+    for (; i + needle_len - 1 + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *) (haystack + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *) (haystack + i + needle_len - 1));
+        uint32_t mask = (uint32_t) _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                                        _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            const char *candidate = haystack + i + __builtin_ctz(mask);
+            if (memcmp(candidate + 1, needle + 1, needle_len - 2) == 0)
+                return candidate;
+            mask &= mask - 1;
+        }
+    }
+    return find_string_sse2(haystack + i, len - i, needle, needle_len);
+}
+#endif
+
+size_t (*count_byte)(const char *, size_t, char) = count_byte_scalar;
+size_t (*count_words)(const char *, size_t, bool *) = count_words_scalar;
+const char *(*find_string)(const char *, size_t, const char *, size_t) = find_string_scalar;
+
+// picks the widest implementations, every filter calls this before scanning
+void init_filter_scan() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2");
+    count_byte = avx2 ? count_byte_avx2 : count_byte_sse2;
+    count_words = avx2 ? count_words_avx2 : count_words_sse2;
+    find_string = avx2 ? find_string_avx2 : find_string_sse2;
+#endif
+}
+
+// selected lines are gathered here and written in large blocks
+char filter_out[FILTER_OUT_SIZE];
+size_t filter_out_len = 0;
+
+void filter_flush() {
+    write_all(STDOUT_FILENO, filter_out, filter_out_len);
+    filter_out_len = 0;
+}
+
+void filter_write(const char *p, size_t len) {
+    if (filter_out_len + len > FILTER_OUT_SIZE) {
+        filter_flush();
+        if (len >= FILTER_OUT_SIZE) { // long runs go out as they are
+            write_all(STDOUT_FILENO, p, len);
+            return;
+        }
+    }
+    memcpy(filter_out + filter_out_len, p, len);
+    filter_out_len += len;
+}
+
+// an input named on the command line, "-" is stdin; prints the error and returns -1
+int filter_open(const char *name, const char *filter) {
+    if (strcmp(name, "-") == 0)
+        return STDIN_FILENO;
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        fprintf(stderr, "-%s: %s: %s: %s\n", sysname, filter, name, strerror(errno));
+    else
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    return fd;
+}
+
+ssize_t filter_read(int fd, char *buf, size_t len) {
+    ssize_t n;
+    while ((n = read(fd, buf, len)) == -1 && errno == EINTR);
+    return n;
+}
+
+// Patterns for match: plain strings, or regexes made of literals, ".", "[...]"
+// classes, "*", "+" and "?" repeats, "\" escapes and the anchors "^" and "$".
+// The longest run of characters that must appear literally is searched with
+// find_string() first, and only the lines that have it are run through an NFA
+// that keeps every state the pattern can be in, so no line is ever backtracked
+// over and a match costs at most the line length times the pattern length.
+
+enum regex_atom_type {
+    ATOM_CHAR,
+    ATOM_ANY,
+    ATOM_CLASS,
+};
+
+struct regex_atom {
+    enum regex_atom_type type;
+    unsigned char c;
+    uint8_t class[32]; // bitmap of the bytes in a [...] class
+    int min, max; // repeat count, max is INT_MAX for * and +
+};
+
+struct regex {
+    struct regex_atom *atoms;
+    int count;
+    bool anchor_start, anchor_end;
+    bool plain; // the literal is the whole pattern, found means matched
+    char *literal;
+    size_t literal_len;
+    int *states; // two lists of count + 1 NFA states, for the current and the next byte
+    unsigned long *seen; // step in which a state was last listed
+    unsigned long step;
+};
+
+/**
+ * Compile a match pattern.
+ * @param  re      filled in, atoms and literal are malloc()ed
+ * @param  pattern the pattern
+ * @return         false on an unterminated class or a trailing backslash
+ */
+bool regex_compile(struct regex *re, const char *pattern) {
+    size_t len = strlen(pattern);
+    memset(re, 0, sizeof(*re));
+    re->atoms = calloc(len + 1, sizeof(struct regex_atom));
+    re->literal = malloc(len + 1);
+    const char *p = pattern, *end = pattern + len;
+    if (p < end && *p == '^') {
+        re->anchor_start = true;
+        p++;
+    }
+    while (p < end) {
+        if (*p == '$' && p + 1 == end) {
+            re->anchor_end = true;
+            break;
+        }
+        struct regex_atom *atom = &re->atoms[re->count++];
+        atom->min = atom->max = 1;
+        if (*p == '.') {
+            atom->type = ATOM_ANY;
+            p++;
+        } else if (*p == '[') {
+            atom->type = ATOM_CLASS;
+            bool negate = ++p < end && *p == '^';
+            if (negate)
+                p++;
+            const char *first = p;
+            while (p < end && (*p != ']' || p == first)) {
+                unsigned char from = *p, to = *p;
+                if (p + 2 < end && p[1] == '-' && p[2] != ']') {
+                    to = p[2];
+                    p += 2;
+                }
+                for (int c = from; c <= to; ++c)
+                    atom->class[c / 8] |= 1 << (c % 8);
+                p++;
+            }
+            if (p == end)
+                return false;
+            p++; // ]
+            if (negate)
+                for (int i = 0; i < 32; ++i)
+                    atom->class[i] = ~atom->class[i];
+        } else {
+            if (*p == '\\' && ++p == end)
+                return false;
+            atom->type = ATOM_CHAR;
+            atom->c = *p++;
+        }
+        if (p < end && (*p == '*' || *p == '+' || *p == '?')) {
+            atom->min = *p == '+';
+            atom->max = *p == '?' ? 1 : INT_MAX;
+            p++;
+        }
+    }
+
+    // the longest run of characters that appear exactly once in a row
+    for (int i = 0; i < re->count;) {
+        int run = i;
+        while (run < re->count && re->atoms[run].type == ATOM_CHAR && re->atoms[run].min == 1
+               && re->atoms[run].max == 1)
+            run++;
+        if ((size_t) (run - i) > re->literal_len) {
+            re->literal_len = run - i;
+            for (int j = i; j < run; ++j)
+                re->literal[j - i] = re->atoms[j].c;
+        }
+        i = run > i ? run : i + 1;
+    }
+    re->plain = !re->anchor_start && !re->anchor_end && re->literal_len == (size_t) re->count;
+    re->states = malloc(sizeof(int) * 2 * (re->count + 1));
+    re->seen = calloc(re->count + 1, sizeof(unsigned long));
+    return true;
+}
+
+void regex_free(struct regex *re) {
+    free(re->atoms);
+    free(re->literal);
+    free(re->states);
+    free(re->seen);
+}
+
+bool atom_matches(const struct regex_atom *atom, unsigned char c) {
+    if (atom->type == ATOM_CHAR)
+        return c == atom->c;
+    if (atom->type == ATOM_CLASS)
+        return atom->class[c / 8] & (1 << (c % 8));
+    return true;
+}
+
+// State i is about to match atom i, state count has matched them all. Adds
+// state i to the list along with the states after it that atoms which may
+// repeat zero times let it skip to.
+void regex_add_state(struct regex *re, int *list, int *n, int i) {
+    while (i <= re->count && re->seen[i] != re->step) {
+        re->seen[i] = re->step;
+        list[(*n)++] = i;
+        if (i == re->count || re->atoms[i].min > 0)
+            break;
+        i++;
+    }
+}
+
+// line is [line, end) without its newline
+bool regex_match_line(struct regex *re, const char *line, const char *end) {
+    int *current = re->states, *next = re->states + re->count + 1;
+    int count = 0;
+    re->step++;
+    regex_add_state(re, current, &count, 0);
+    for (const char *p = line;; ++p) {
+        for (int k = 0; k < count; ++k)
+            if (current[k] == re->count && (!re->anchor_end || p == end))
+                return true;
+        if (p == end || (count == 0 && re->anchor_start))
+            return false;
+        int next_count = 0;
+        re->step++;
+        for (int k = 0; k < count; ++k) {
+            int i = current[k];
+            if (i == re->count || !atom_matches(&re->atoms[i], *p))
+                continue;
+            if (re->atoms[i].max > 1) // * and + may take another
+                regex_add_state(re, next, &next_count, i);
+            regex_add_state(re, next, &next_count, i + 1);
+        }
+        if (!re->anchor_start) // a match may also start at the next byte
+            regex_add_state(re, next, &next_count, 0);
+        int *swap = current;
+        current = next;
+        next = swap;
+        count = next_count;
+    }
+}
+
+struct match_state {
+    struct regex re;
+    bool invert; // -v
+    bool count_only; // -c
+    size_t selected;
+};
+
+// selects from buf[0, len), which holds whole lines and ends with a newline
+void match_lines(struct match_state *m, const char *buf, size_t len) {
+    const char *pos = buf, *end = buf + len;
+    while (pos < end) {
+        const char *line = pos;
+        if (m->re.literal_len > 0) {
+            const char *hit = find_string(pos, end - pos, m->re.literal, m->re.literal_len);
+            if (hit != NULL) {
+                line = memrchr(pos, '\n', hit - pos);
+                line = line ? line + 1 : pos;
+            } else {
+                line = end;
+            }
+            if (m->invert && line > pos) { // every line before the hit is selected
+                m->selected += count_byte(pos, line - pos, '\n');
+                if (!m->count_only)
+                    filter_write(pos, line - pos);
+            }
+            if (hit == NULL)
+                break;
+        }
+        const char *line_end = (const char *) memchr(line, '\n', end - line) + 1;
+        bool matched = m->re.plain || regex_match_line(&m->re, line, line_end - 1);
+        if (matched != m->invert) {
+            m->selected++;
+            if (!m->count_only)
+                filter_write(line, line_end - line);
+        }
+        pos = line_end;
+    }
+}
+
+// runs match over one input, a last line without a newline gets one
+int match_input(struct match_state *m, int fd, char **buf, size_t *capacity) {
+    size_t kept = 0;
+    ssize_t n;
+    while ((n = filter_read(fd, *buf + kept, *capacity - kept)) > 0) {
+        size_t filled = kept + n;
+        const char *last = memrchr(*buf, '\n', filled);
+        if (last == NULL) {
+            kept = filled;
+        } else {
+            size_t whole = last + 1 - *buf;
+            match_lines(m, *buf, whole);
+            kept = filled - whole;
+            memmove(*buf, *buf + whole, kept);
+        }
+        if (kept == *capacity) { // one line longer than the buffer
+            *capacity *= 2;
+            *buf = realloc(*buf, *capacity);
+        }
+    }
+    if (kept > 0) {
+        (*buf)[kept++] = '\n'; // kept < capacity, the buffer grows when it fills
+        match_lines(m, *buf, kept);
+    }
+    return n == -1 ? -1 : 0;
+}
+
+/**
+ * match [-v] [-c] pattern [file...]
+ * Prints the lines of the files, or of stdin, that contain the pattern; with
+ * -v the ones that do not, with -c only how many.
+ * @return 0 if a line was selected, 1 if none was and 2 on errors, like grep
+ */
+int match_command(struct command_t *command) {
+    struct match_state m = {0};
+    int i = 0;
+    for (; i < command->arg_count && command->args[i][0] == '-' && command->args[i][1] != 0; ++i) {
+        if (strcmp(command->args[i], "-v") == 0)
+            m.invert = true;
+        else if (strcmp(command->args[i], "-c") == 0)
+            m.count_only = true;
+        else {
+            i += strcmp(command->args[i], "--") == 0;
+            break;
+        }
+    }
+    if (i == command->arg_count) {
+        fprintf(stderr, "-%s: match: usage: match [-v] [-c] pattern [file...]\n", sysname);
+        return UNKNOWN;
+    }
+    if (!regex_compile(&m.re, command->args[i++])) {
+        fprintf(stderr, "-%s: match: %s: bad pattern\n", sysname, command->args[i - 1]);
+        regex_free(&m.re);
+        return UNKNOWN;
+    }
+    init_filter_scan();
+
+    size_t capacity = FILTER_CHUNK;
+    char *buf = malloc(capacity);
+    bool failed = false;
+    int first = i;
+    for (; i < command->arg_count || i == first; ++i) {
+        const char *name = i < command->arg_count ? command->args[i] : "-";
+        int fd = filter_open(name, "match");
+        if (fd == -1 || match_input(&m, fd, &buf, &capacity) == -1) {
+            if (fd != -1)
+                fprintf(stderr, "-%s: match: %s: %s\n", sysname, name, strerror(errno));
+            failed = true;
+        }
+        if (fd > STDIN_FILENO)
+            close(fd);
+    }
+    if (m.count_only) {
+        char line[32];
+        filter_write(line, snprintf(line, sizeof(line), "%zu\n", m.selected));
+    }
+    filter_flush();
+    free(buf);
+    regex_free(&m.re);
+    if (failed)
+        return UNKNOWN;
+    return m.selected > 0 ? SUCCESS : 1;
+}
+
+// prints the counts that were asked for, in wc's order
+void print_counts(const size_t counts[3], const bool wanted[3], const char *name) {
+    char line[128];
+    size_t used = 0;
+    for (int k = 0; k < 3; ++k)
+        if (wanted[k])
+            used += snprintf(line + used, sizeof(line) - used, "%s%zu", used ? " " : "", counts[k]);
+    if (name)
+        used += snprintf(line + used, sizeof(line) - used, " %s", name);
+    line[used++] = '\n';
+    filter_write(line, used);
+}
+
+/**
+ * count [-l] [-w] [-c] [file...]
+ * Counts lines, words and bytes like wc, all three without options. Bytes
+ * alone of a regular file come from its size without reading it.
+ * @return 0, or 2 if an input could not be read
+ */
+int count_command(struct command_t *command) {
+    bool wanted[3] = {false, false, false}; // lines, words, bytes
+    int i = 0;
+    for (; i < command->arg_count && command->args[i][0] == '-' && command->args[i][1] != 0; ++i) {
+        for (const char *option = command->args[i] + 1; *option; ++option) {
+            const char *known = strchr("lwc", *option);
+            if (known == NULL) {
+                fprintf(stderr, "-%s: count: usage: count [-l] [-w] [-c] [file...]\n", sysname);
+                return UNKNOWN;
+            }
+            wanted[known - "lwc"] = true;
+        }
+    }
+    if (!wanted[0] && !wanted[1] && !wanted[2])
+        wanted[0] = wanted[1] = wanted[2] = true;
+    init_filter_scan();
+
+    char *buf = malloc(FILTER_CHUNK);
+    size_t total[3] = {0, 0, 0};
+    int first = i, inputs = 0;
+    bool failed = false;
+    for (; i < command->arg_count || i == first; ++i) {
+        const char *name = i < command->arg_count ? command->args[i] : NULL;
+        int fd = filter_open(name ? name : "-", "count");
+        if (fd == -1) {
+            failed = true;
+            continue;
+        }
+        size_t counts[3] = {0, 0, 0};
+        bool in_word = false;
+        struct stat st;
+        ssize_t n = 0;
+        if (!wanted[0] && !wanted[1] && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            off_t at = lseek(fd, 0, SEEK_CUR);
+            counts[2] = st.st_size > at && at >= 0 ? st.st_size - at : 0;
+        } else {
+            while ((n = filter_read(fd, buf, FILTER_CHUNK)) > 0) {
+                counts[2] += n;
+                if (wanted[0])
+                    counts[0] += count_byte(buf, n, '\n');
+                if (wanted[1])
+                    counts[1] += count_words(buf, n, &in_word);
+            }
+        }
+        if (n == -1) {
+            fprintf(stderr, "-%s: count: %s: %s\n", sysname, name ? name : "-", strerror(errno));
+            failed = true;
+        }
+        for (int k = 0; k < 3; ++k)
+            total[k] += counts[k];
+        print_counts(counts, wanted, name);
+        inputs++;
+        if (fd > STDIN_FILENO)
+            close(fd);
+    }
+    if (inputs > 1)
+        print_counts(total, wanted, "total");
+    filter_flush();
+    free(buf);
+    return failed ? UNKNOWN : SUCCESS;
+}
+
+// copies the first limit lines, or bytes, of fd to stdout; returns -1 on a read error
+int head_input(int fd, char *buf, size_t limit, bool bytes) {
+    ssize_t n;
+    while (limit > 0 && (n = filter_read(fd, buf, FILTER_CHUNK)) > 0) {
+        size_t take = n, lines;
+        if (bytes) {
+            if (take > limit)
+                take = limit;
+            limit -= take;
+        } else if ((lines = count_byte(buf, n, '\n')) < limit) {
+            limit -= lines;
+        } else { // the last wanted newline is in this chunk
+            const char *p = buf;
+            while (limit > 0) {
+                p = (const char *) memchr(p, '\n', buf + n - p) + 1;
+                limit--;
+            }
+            take = p - buf;
+        }
+        if (write_all(STDOUT_FILENO, buf, take) == -1)
+            return 0; // the reader is gone, nothing more to do
+    }
+    return limit > 0 && n == -1 ? -1 : 0;
+}
+
+// runs the program a filter builtin stands in for, with options the builtin lacks
+int filter_fallback(struct command_t *command) {
+    const char *path = hash_lookup(command->name);
+    if (path != NULL)
+        execv(path, command->argv);
+    fprintf(stderr, "-%s: %s: %s: unsupported option\n", sysname, command->name, command->args[0]);
+    return UNKNOWN;
+}
+
+// a head count, false for anything the builtin leaves to the real head
+bool head_count(const char *arg, long *limit) {
+    char *end;
+    *limit = strtol(arg, &end, 10);
+    return end != arg && *end == 0 && *limit >= 0;
+}
+
+/**
+ * head [-n N | -nN | --lines=N | -N] [-c N | -cN | --bytes=N] [-q | -v] [file...]
+ * Prints the first N lines (default 10) or bytes of each input and exits, so
+ * the stage before it stops on the closed pipe. Several inputs, or -v, get
+ * "==> name <==" headers. Options it does not know, such as negative counts
+ * or size suffixes, are handed to the head found in $PATH.
+ * @return 0, or 2 if an input could not be read
+ */
+int head_command(struct command_t *command) {
+    long limit = 10;
+    bool bytes = false, quiet = false, verbose = false;
+    int i = 0;
+    for (; i < command->arg_count && command->args[i][0] == '-' && command->args[i][1] != 0; ++i) {
+        const char *arg = command->args[i];
+        bool known = true;
+        if (strcmp(arg, "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(arg, "-q") == 0 || strcmp(arg, "--quiet") == 0 || strcmp(arg, "--silent") == 0) {
+            quiet = true;
+            verbose = false;
+        } else if (strcmp(arg, "-v") == 0 || strcmp(arg, "--verbose") == 0) {
+            verbose = true;
+            quiet = false;
+        } else if (strcmp(arg, "-n") == 0 || strcmp(arg, "-c") == 0 || strcmp(arg, "--lines") == 0
+                   || strcmp(arg, "--bytes") == 0) {
+            bytes = arg[1] == 'c' || arg[2] == 'b';
+            known = i + 1 < command->arg_count && head_count(command->args[++i], &limit);
+        } else if (strncmp(arg, "--lines=", 8) == 0 || strncmp(arg, "--bytes=", 8) == 0) {
+            bytes = arg[2] == 'b';
+            known = head_count(arg + 8, &limit);
+        } else if (arg[1] == 'n' || arg[1] == 'c') {
+            bytes = arg[1] == 'c';
+            known = head_count(arg + 2, &limit);
+        } else {
+            known = arg[1] >= '0' && arg[1] <= '9' && head_count(arg + 1, &limit);
+        }
+        if (!known)
+            return filter_fallback(command);
+    }
+    init_filter_scan();
+
+    char *buf = malloc(FILTER_CHUNK);
+    bool failed = false;
+    int first = i;
+    bool headers = verbose || (!quiet && command->arg_count - first > 1);
+    for (; i < command->arg_count || i == first; ++i) {
+        const char *name = i < command->arg_count ? command->args[i] : "-";
+        int fd = filter_open(name, "head");
+        if (fd != -1 && headers) {
+            char header[PATH_MAX + 16];
+            int len = snprintf(header, sizeof(header), "%s==> %s <==\n", i > first ? "\n" : "",
+                               strcmp(name, "-") == 0 ? "standard input" : name);
+            write_all(STDOUT_FILENO, header, len < (int) sizeof(header) ? len : (int) sizeof(header) - 1);
+        }
+        if (fd == -1 || head_input(fd, buf, limit, bytes) == -1) {
+            if (fd != -1)
+                fprintf(stderr, "-%s: head: %s: %s\n", sysname, name, strerror(errno));
+            failed = true;
+        }
+        if (fd > STDIN_FILENO)
+            close(fd);
+    }
+    free(buf);
+    return failed ? UNKNOWN : SUCCESS;
+}
+
+
+// psvis: process tree read straight from /proc.
+// Every /proc/<pid>/stat is read once into a flat array, the tree is linked
+// through a pid -> index hash in one more pass and printed depth first.
+
+struct proc_record {
+    pid_t pid;
+    pid_t ppid;
+    long rss_kb;
+    unsigned long long cpu_ticks; // utime + stime
+    char comm[32];
+    int first_child;
+    int next_sibling;
+};
+
+// parses one /proc/<pid>/stat line, comm may itself contain spaces and ')'
+bool parse_proc_stat(char *line, struct proc_record *record) {
+    char *open = strchr(line, '(');
+    char *close = strrchr(line, ')');
+    if (open == NULL || close == NULL || close < open)
+        return false;
+    record->pid = atoi(line);
+    size_t len = close - open - 1;
+    if (len >= sizeof(record->comm))
+        len = sizeof(record->comm) - 1;
+    memcpy(record->comm, open + 1, len);
+    record->comm[len] = 0;
+
+    // fields after comm, starting with field 3 (state)
+    char *p = close + 2;
+    unsigned long long utime = 0, stime = 0;
+    long rss = 0;
+    for (int field = 3; field <= 24 && *p; ++field) {
+        if (field == 4)
+            record->ppid = atoi(p);
+        else if (field == 14)
+            utime = strtoull(p, NULL, 10);
+        else if (field == 15)
+            stime = strtoull(p, NULL, 10);
+        else if (field == 24)
+            rss = atol(p);
+        p = strchr(p, ' ');
+        if (p == NULL)
+            break;
+        p++;
+    }
+    record->cpu_ticks = utime + stime;
+    record->rss_kb = rss * (sysconf(_SC_PAGESIZE) / 1024);
+    return true;
+}
+
+// reads every process in /proc, returns the number of records
+int read_proc_records(struct proc_record **records) {
+    int capacity = 1024, count = 0;
+    *records = malloc(sizeof(struct proc_record) * capacity);
+    int proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (proc_fd == -1)
+        return 0;
+
+    char *dents = malloc(1 << 16);
+    long n;
+    while ((n = syscall(SYS_getdents64, proc_fd, dents, 1 << 16)) > 0) {
+        for (long offset = 0; offset < n;) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *) (dents + offset);
+            offset += d->d_reclen;
+            if (d->d_name[0] < '0' || d->d_name[0] > '9')
+                continue;
+
+            char path[64], line[1024];
+            snprintf(path, sizeof(path), "%s/stat", d->d_name);
+            int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+                continue; // exited while we were reading
+            ssize_t len = read(fd, line, sizeof(line) - 1);
+            close(fd);
+            if (len <= 0)
+                continue;
+            line[len] = 0;
+
+            if (count == capacity) {
+                capacity *= 2;
+                *records = realloc(*records, sizeof(struct proc_record) * capacity);
+            }
+            if (parse_proc_stat(line, &(*records)[count]))
+                count++;
+        }
+    }
+    free(dents);
+    close(proc_fd);
+    return count;
+}
+
+// open addressing pid -> record index, size is a power of two
+int proc_index_find(int *table, int mask, struct proc_record *records, pid_t pid) {
+    for (unsigned int h = (unsigned int) pid * 2654435761u;; ++h) {
+        int slot = table[h & mask];
+        if (slot == -1 || records[slot].pid == pid)
+            return slot;
+    }
+}
+
+void proc_index_insert(int *table, int mask, struct proc_record *records, int index) {
+    unsigned int h = (unsigned int) records[index].pid * 2654435761u;
+    while (table[h & mask] != -1)
+        h++;
+    table[h & mask] = index;
+}
+
+/**
+ * psvis [root pid] [max depth]
+ * Prints the process tree below root (or the whole tree) with pid, rss and cpu time.
+ * Runs inside the shell, ps/pstree are never started.
+ */
+int psvis(struct command_t *command) {
+    pid_t root_pid = 0;
+    int max_depth = INT_MAX;
+    char *end;
+    bool valid = command->arg_count <= 2;
+    if (valid && command->arg_count > 0) {
+        long n = strtol(command->args[0], &end, 10);
+        valid = end != command->args[0] && *end == 0 && n > 0 && n <= INT_MAX;
+        root_pid = n;
+    }
+    if (valid && command->arg_count > 1) {
+        long n = strtol(command->args[1], &end, 10);
+        valid = end != command->args[1] && *end == 0 && n >= 0 && n <= INT_MAX;
+        max_depth = n;
+    }
+    if (!valid) {
+        printf("-%s: psvis: usage: psvis [root pid] [max depth]\n", sysname);
+        return UNKNOWN;
+    }
+    long ticks_per_second = sysconf(_SC_CLK_TCK);
+
+    struct proc_record *records;
+    int count = read_proc_records(&records);
+    if (count == 0) {
+        fprintf(stderr, "-%s: psvis: cannot read /proc\n", sysname);
+        return 1;
+    }
+
+    int size = 1;
+    while (size < count * 2)
+        size <<= 1;
+    int *table = malloc(sizeof(int) * size);
+    memset(table, -1, sizeof(int) * size);
+    for (int i = 0; i < count; ++i) {
+        records[i].first_child = records[i].next_sibling = -1;
+        proc_index_insert(table, size - 1, records, i);
+    }
+
+    // link children, walking backwards keeps siblings in ascending pid order
+    int roots = -1;
+    for (int i = count - 1; i >= 0; --i) {
+        int parent = records[i].ppid == records[i].pid ? -1 : proc_index_find(table, size - 1, records, records[i].ppid);
+        if (parent == -1) {
+            records[i].next_sibling = roots;
+            roots = i;
+        } else {
+            records[i].next_sibling = records[parent].first_child;
+            records[parent].first_child = i;
+        }
+    }
+    if (root_pid != 0) {
+        roots = proc_index_find(table, size - 1, records, root_pid);
+        if (roots == -1) {
+            fprintf(stderr, "-%s: psvis: %d: no such process\n", sysname, root_pid);
+            free(table);
+            free(records);
+            return 1;
+        }
+        records[roots].next_sibling = -1;
+    }
+
+    // iterative depth-first walk, stack holds the next node to print at each depth
+    // and prefix_lens the length of the "│  " connectors in front of that depth
+    int *stack = malloc(sizeof(int) * (count + 1));
+    size_t *prefix_lens = malloc(sizeof(size_t) * (count + 1));
+    char *prefix = malloc(count * 5 + 1);
+    int depth = 0;
+    stack[0] = roots;
+    prefix_lens[0] = 0;
+    prefix[0] = 0;
+    while (depth >= 0) {
+        int i = stack[depth];
+        if (i == -1) { // no more siblings, go back up
+            depth--;
+            if (depth >= 0)
+                prefix[prefix_lens[depth]] = 0;
+            continue;
+        }
+        struct proc_record *r = &records[i];
+        bool last = r->next_sibling == -1;
+        stack[depth] = r->next_sibling;
+        printf("%s%s%s(%d) rss=%ldK cpu=%.2fs\n", prefix, depth == 0 ? "" : (last ? "└─ " : "├─ "),
+               r->comm, r->pid, r->rss_kb, (double) r->cpu_ticks / ticks_per_second);
+
+        if (r->first_child != -1 && depth + 1 <= max_depth) {
+            size_t len = prefix_lens[depth];
+            if (depth > 0) { // the root level has no connector to continue
+                const char *bar = last ? "   " : "│  ";
+                strcpy(prefix + len, bar);
+                len += strlen(bar);
+            }
+            stack[++depth] = r->first_child;
+            prefix_lens[depth] = len;
+        }
+    }
+
+    free(prefix_lens);
+    free(prefix);
+    free(stack);
+    free(table);
+    free(records);
+    return 0;
+}
+
+// hash: without arguments lists hashed commands with their hit counts,
+// "hash -r" forgets everything, "hash -l" prints name=path pairs
+// and "hash name..." looks the names up in $PATH ahead of time.
+int hash_command(struct command_t *command) {
+    if (command->arg_count == 0) {
+        if (command_hash_count == 0)
+            printf("%s: hash table empty\n", sysname);
+        else
+            printf("hits\tcommand\n");
+        for (int i = 0; i < HASH_BUCKETS; ++i)
+            for (struct hash_entry *e = command_hash[i]; e; e = e->next)
+                printf("%4lu\t%s\n", e->hits, e->path);
+        printf("lookups: %lu hits, %lu misses\n", hash_hits, hash_misses);
+        return SUCCESS;
+    }
+    if (strcmp(command->args[0], "-r") == 0) {
+        hash_forget_from(0);
+        hash_hits = hash_misses = 0;
+        return SUCCESS;
+    }
+    if (strcmp(command->args[0], "-l") == 0) {
+        for (int i = 0; i < HASH_BUCKETS; ++i)
+            for (struct hash_entry *e = command_hash[i]; e; e = e->next)
+                printf("%s=%s\n", e->name, e->path);
+        return SUCCESS;
+    }
+    for (int i = 0; i < command->arg_count; ++i) {
+        if (strchr(command->args[i], '/') != NULL || is_builtin(command->args[i]))
+            continue;
+        if (hash_lookup(command->args[i]) == NULL)
+            printf("-%s: hash: %s: not found\n", sysname, command->args[i]);
+    }
+    return SUCCESS;
 }